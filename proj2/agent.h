@@ -15,9 +15,18 @@
 #include <type_traits>
 #include <algorithm>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <sys/wait.h>
 #include "board.h"
 #include "action.h"
 #include "weight.h"
+#include "arena.h"
+#include "transposition.h"
+#include "pool.h"
 
 class agent {
 public:
@@ -60,6 +69,10 @@ public:
 	random_agent(const std::string& args = "") : agent(args) {
 		if (meta.find("seed") != meta.end())
 			engine.seed(int(meta["seed"]));
+		if (meta.find("stream") != meta.end()) { // an independent stream for each worker thread
+			std::seed_seq seq{ unsigned(engine()), unsigned(int(meta["stream"])) };
+			engine.seed(seq);
+		}
 	}
 	virtual ~random_agent() {}
 
@@ -68,18 +81,87 @@ protected:
 };
 
 
+/**
+ * default random environment, i.e., placer
+ * place the hint tile and decide a new hint tile
+ */
+class random_placer : public random_agent {
+public:
+	random_placer(const std::string& args = "") : random_agent("name=place role=placer " + args) {}
+
+	virtual action take_action(const board& after) {
+		std::vector<int> space = spaces(after.last());
+		std::shuffle(space.begin(), space.end(), engine);
+		for (int pos : space) {
+			if (after(pos) != 0) continue;
+
+			int bag[3], num = 0;
+			for (board::cell t = 1; t <= 3; t++)
+				for (size_t i = 0; i < after.bag(t); i++)
+					bag[num++] = t;
+			std::shuffle(bag, bag + num, engine);
+
+			board::cell tile = after.hint() ?: bag[--num];
+			board::cell hint = bag[--num];
+
+			return action::place(pos, tile, hint);
+		}
+		return action();
+	}
+
+	/**
+	 * the positions where a tile may be placed after the given last action,
+	 * i.e., the opposite edge of a slide (URDL), or anywhere before the first slide
+	 */
+	static const std::vector<int>& spaces(unsigned last) {
+		static const std::vector<int> space[] = {
+			{ 12, 13, 14, 15 },
+			{ 0, 4, 8, 12 },
+			{ 0, 1, 2, 3},
+			{ 3, 7, 11, 15 },
+			{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+		};
+		return space[last];
+	}
+};
+
 /**
  * base agent for agents with weight tables and a learning rate
  */
 class weight_agent : public agent {
 public:
 	weight_agent(const std::string& args = "") : agent(args), alpha(0.1f) {
-		// if (meta.find("init") != meta.end())
-		// 	init_weights(meta["init"]);
 		// if (meta.find("load") != meta.end())
 		// 	load_weights(meta["load"]);
 		if (meta.find("alpha") != meta.end())
 			alpha = float(meta["alpha"]);
+		if (meta.find("checkpoint") != meta.end()) {
+			std::string every = meta["checkpoint"]; // e.g., every:100000
+			saving = std::make_shared<checkpoint>();
+			saving->every = std::stoull(every.substr(every.find(':') + 1));
+			if (meta.find("save") != meta.end()) saving->path = std::string(meta["save"]);
+			else saving.reset(), std::cerr << "checkpoint is ignored since save= is not given" << std::endl;
+		}
+	}
+	/**
+	 * a worker sharing the weight tables of the given agent, e.g., for parallel training
+	 * the tables stay owned by the given agent, and the workers update them without locks
+	 */
+	weight_agent(const weight_agent& shared) : agent(shared), net(shared.net), alpha(shared.alpha), saving(shared.saving) {
+		meta.erase("save"); // only the owner saves the tables
+	}
+	/**
+	 * copy the weight tables of the given agent into the own tables, which are allocated on the first copy
+	 * the given tables may be updated by other threads meanwhile, so the copy is only roughly consistent
+	 */
+	virtual void snapshot_weights(const weight_agent& from) {
+		if (memory.data() == nullptr) allocate_weights(false); // a snapshot is never updated
+		for (size_t k = 0; k < net.size(); k++)
+			std::copy(from.net[k].table(), from.net[k].table() + net[k].size(), net[k].table());
+	}
+	virtual void notify(const std::string& msg) {
+		agent::notify(msg);
+		if (msg.find("alpha=") == 0) alpha = float(meta["alpha"]);
 	}
 	virtual ~weight_agent() {
 		// if (meta.find("save") != meta.end())
@@ -87,98 +169,489 @@ public:
 	}
 
 protected:
-	void init_weights(const std::string& info) {
-		// std::cout << "init_weights: " << info << std::endl;
-
-		std::string res = info; // comma-separated sizes, e.g., "65536,65536"
+	/**
+	 * build the network from its topology, i.e., comma-separated tuples of hexadecimal cells
+	 * with the isomorphic level, e.g., "0123,4567,89ab,cdef" with 8
+	 * each tuple has at most max_cells distinct cells, since a table has 16^n weights
+	 */
+	static const size_t max_cells = 8;
+	void build_weights(const std::string& tuples, size_t iso) {
+		if (iso != 1 && iso != 4 && iso != 8) {
+			std::cerr << "invalid isomorphic level: " << iso << std::endl;
+			std::exit(-1);
+		}
+		std::string res = tuples;
 		for (char& ch : res)
-			if (!std::isdigit(ch)) ch = ' ';
+			if (ch == ',') ch = ' ';
 		std::stringstream in(res);
-		for (size_t size; in >> size; net.emplace_back(size));
-
-		// for (int i=0; i < (int) net.size(); i++)	std::cout << net[i] << " " << std::endl;
+		for (std::string cells; in >> cells; ) {
+			std::vector<weight::score> p;
+			bool valid = cells.size() <= max_cells;
+			for (char ch : cells) {
+				weight::score c = std::isxdigit(ch) ? std::stoi(std::string(1, ch), nullptr, 16) : 16;
+				valid = valid && c <= 0xf && std::find(p.begin(), p.end(), c) == p.end();
+				p.push_back(c);
+			}
+			if (!valid) {
+				std::cerr << "invalid tuple: " << cells << " (at most " << max_cells << " distinct cells 0-f)" << std::endl;
+				std::exit(-1);
+			}
+			net.emplace_back(p, iso);
+		}
+		if (net.empty()) {
+			std::cerr << "invalid topology: " << tuples << std::endl;
+			std::exit(-1);
+		}
+		allocate_weights();
+	}
+	std::string topology() const {
+		std::string tuples;
+		for (const weight& w : net) tuples += (tuples.size() ? "," : "") + w.nameof(w.isomorphism[0]);
+		return tuples;
+	}
+	/**
+	 * read the topology saved in a weight file, see build_weights
+	 * return false if the file cannot be read
+	 */
+	static bool read_topology(const std::string& path, std::string& tuples, size_t& iso) {
+		std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!in.is_open()) return false;
+		uint64_t length = in.tellg(); // the counts and lengths read from the file are bounded by its size
+		auto invalid = [&]() {
+			std::cerr << path << ": invalid weights" << std::endl;
+			std::exit(-1);
+		};
+		in.seekg(0);
+		std::vector<std::string> names;
+		iso = weight::iso_level_;
+		file_header head;
+		in.read(reinterpret_cast<char*>(&head), sizeof(head));
+		if (in && head.valid()) {
+			if (head.count > (length - sizeof(file_header)) / sizeof(table_header)) invalid();
+			std::vector<table_header> tables(head.count);
+			in.read(reinterpret_cast<char*>(tables.data()), sizeof(table_header) * tables.size());
+			for (const table_header& t : tables)
+				if (!t.is_coherence()) names.emplace_back(t.name);
+			if (tables.size()) iso = tables[0].level();
+		} else { // the stream layout, skip the tables but the names
+			in.clear();
+			in.seekg(0);
+			uint32_t count = 0;
+			in.read(reinterpret_cast<char*>(&count), sizeof(count));
+			for (uint32_t i = 0; i < count && in; i++) {
+				uint32_t len = 0;
+				in.read(reinterpret_cast<char*>(&len), sizeof(len));
+				if (len > length) invalid();
+				std::string name(len, '\0');
+				in.read(&name[0], len);
+				uint64_t size = 0;
+				in.read(reinterpret_cast<char*>(&size), sizeof(size));
+				in.seekg(sizeof(weight::type) * size, std::ios::cur);
+				names.push_back(name);
+			}
+		}
+		if (!in || names.empty()) return false;
+		tuples.clear();
+		for (const std::string& name : names) // e.g., "6-tuple pattern 012345"
+			tuples += (tuples.size() ? "," : "") + name.substr(name.find_last_of(' ') + 1);
+		return true;
+	}
+	// lay out all the tables of net in one zero-filled arena, with the accumulators of tc=1 only if the tables are updated
+	void allocate_weights(bool updated = true) {
+		bool huge = meta.find("hugepage") == meta.end() || int(meta["hugepage"]);
+		size_t total = 0;
+		for (weight& w : net) total = arena::align(total) + w.size() * sizeof(weight::type);
+		bool tc = updated && meta.find("tc") != meta.end() && int(meta["tc"]);
+		if (tc) for (weight& w : net) total = arena::align(total) + w.size() * 2 * sizeof(weight::type);
+		try {
+			memory.allocate(total, huge);
+		} catch (std::bad_alloc&) {
+			std::cerr << "cannot allocate " << total << " bytes for the weights" << std::endl;
+			std::exit(-1);
+		}
+		size_t offset = 0;
+		for (weight& w : net) {
+			offset = arena::align(offset);
+			w.bind(reinterpret_cast<weight::type*>(memory.data() + offset));
+			offset += w.size() * sizeof(weight::type);
+		}
+		for (weight& w : net) { // the accumulators follow all the tables, so that the tables stay close
+			w.bind_coherence(nullptr);
+			if (!tc) continue;
+			offset = arena::align(offset);
+			w.bind_coherence(reinterpret_cast<weight::type*>(memory.data() + offset));
+			offset += w.size() * 2 * sizeof(weight::type);
+		}
+	}
+	/**
+	 * quantize all the tables into a compact arena for inference, see weight::precision
+	 * the type is either "fp32", "int16", or "fp16"
+	 */
+	void quantize_weights(const std::string& type) {
+		weight::precision p = type == "int16" ? weight::int16 : type == "fp16" ? weight::fp16 : weight::fp32;
+		if (p == weight::fp32) return;
+		if (alpha != 0) {
+			std::cerr << "quant=" << type << " is ignored since alpha != 0" << std::endl;
+			return;
+		}
+		bool huge = meta.find("hugepage") == meta.end() || int(meta["hugepage"]);
+		size_t total = 0;
+		for (weight& w : net) total = arena::align(total) + (w.size() + 1) * sizeof(uint16_t);
+		compact.allocate(total, huge);
+		size_t offset = 0;
+		for (weight& w : net) {
+			offset = arena::align(offset);
+			float err = w.quantize(reinterpret_cast<uint16_t*>(compact.data() + offset), p);
+			offset += (w.size() + 1) * sizeof(uint16_t);
+			std::cout << w.name() << " quantized to " << type << ", max error = " << err << std::endl;
+		}
 	}
 	void load_weights(const std::string& path) {
 		// std::cout << "load_weights: " << path << std::endl;
 
 		std::ifstream in(path, std::ios::in | std::ios::binary);
-		if (!in.is_open()) std::exit(-1);
-		uint32_t size;
-		in.read(reinterpret_cast<char*>(&size), sizeof(size));
-		net.resize(size);
-		for (weight& w : net) in >> w;
-		in.close();
+		if (!in.is_open()) {
+			std::cerr << path << ": cannot open the weights" << std::endl;
+			std::exit(-1);
+		}
+		std::string tuples;
+		size_t iso = 0;
+		if (!read_topology(path, tuples, iso) || tuples != topology() || iso != net[0].iso) {
+			std::cerr << path << ": weights of " << tuples << " (iso=" << iso << ") do not match "
+			          << topology() << " (iso=" << net[0].iso << ")" << std::endl;
+			std::exit(-1);
+		}
+		file_header head;
+		in.read(reinterpret_cast<char*>(&head), sizeof(head));
+		if (!in || !head.valid()) { // the stream layout, i.e., the count followed by each weight
+			in.clear();
+			in.seekg(0);
+			uint32_t size;
+			in.read(reinterpret_cast<char*>(&size), sizeof(size));
+			for (weight& w : net) in >> w;
+			if (!in) {
+				std::cerr << path << ": truncated weights" << std::endl;
+				std::exit(-1);
+			}
+			return;
+		}
+		std::vector<table_header> tables(head.count);
+		in.read(reinterpret_cast<char*>(tables.data()), sizeof(table_header) * tables.size());
+		for (size_t i = 0; i < net.size(); i++) {
+			if (tables[i].size != net[i].size()) {
+				std::cerr << path << ": " << tables[i].name << " has " << tables[i].size << " weights" << std::endl;
+				std::exit(-1);
+			}
+		}
+		if (alpha == 0 && memory.map(path)) { // read-only, the tables are used in place
+			for (size_t i = 0; i < net.size(); i++) {
+				if (tables[i].offset + tables[i].size * sizeof(weight::type) > memory.size()) {
+					std::cerr << path << ": truncated weights" << std::endl;
+					std::exit(-1);
+				}
+				net[i].bind(reinterpret_cast<weight::type*>(memory.data() + tables[i].offset));
+				net[i].bind_coherence(nullptr);
+			}
+			return;
+		}
+		for (size_t i = 0; i < net.size(); i++) {
+			in.seekg(tables[i].offset);
+			in.read(reinterpret_cast<char*>(net[i].table()), sizeof(weight::type) * tables[i].size);
+		}
+		for (size_t i = net.size(), k = 0; i < tables.size() && k < net.size(); i++, k++) {
+			// the accumulators are kept only if Temporal Coherence is still enabled, see allocate_weights
+			if (!net[k].coherence_table() || tables[i].name != "tc " + net[k].name()) continue;
+			in.seekg(tables[i].offset);
+			in.read(reinterpret_cast<char*>(net[k].coherence_table()), sizeof(weight::type) * tables[i].size);
+		}
+		if (!in) {
+			std::cerr << path << ": truncated weights" << std::endl;
+			std::exit(-1);
+		}
 	}
+	/**
+	 * the layout of weight files, i.e., a file header, the table headers,
+	 * and then the tables at page-aligned offsets, so that a file can be mapped and used in place
+	 */
+	struct file_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t count;
+		file_header(uint32_t count = 0) : magic{ 'n', '-', 't', 'u', 'p', 'l', 'e', '\0' }, version(1), count(count) {}
+		bool valid() const { return std::equal(magic, magic + 8, file_header().magic) && version == 1; }
+	};
+	struct table_header {
+		uint64_t offset;
+		uint64_t size;
+		char name[44];
+		uint32_t iso; // 0 for files saved before the isomorphic level was configurable, i.e., 8
+		table_header() : offset(0), size(0), name(), iso(0) {}
+		table_header(const weight& w, uint64_t offset, bool coherence = false)
+			: offset(offset), size(w.size() << coherence), name(), iso(w.iso) {
+			(coherence ? "tc " + w.name() : w.name()).copy(name, sizeof(name) - 1);
+		}
+		bool is_coherence() const { return std::string(name).find("tc ") == 0; }
+		size_t level() const { return iso ? iso : weight::iso_level_; }
+	};
+	/**
+	 * the tables to be written and their headers, see write_weights
+	 */
+	struct layout {
+		file_header head;
+		std::vector<table_header> tables;
+		std::vector<const weight::type*> values;
+		std::string path, temp;
+	};
+
 	void save_weights(const std::string& path) {
 		// std::cout << "save_weights: " << path << std::endl;
 
-		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
-		if (!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
-		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for (weight& w : net) out << w;
-		out.close();
+		if (!write_weights(layout_weights(path))) {
+			std::cerr << path << ": cannot save the weights" << std::endl;
+			std::exit(-1);
+		}
+	}
+
+	/**
+	 * save the tables periodically without stopping, i.e., checkpoint=every:N saves to the file of save=
+	 * after every N episodes learned by this agent and its workers
+	 *
+	 * a forked child writes the tables, which are shared with the trainer by copy-on-write,
+	 * so that the trainer only stalls for the fork; a checkpoint is skipped if the last one is still being written
+	 */
+	void checkpoint_weights() {
+		if (!saving || !saving->every) return;
+		if (++saving->episodes % saving->every) return;
+		std::lock_guard<std::mutex> lock(saving->lock);
+		int status = 0;
+		pid_t done = saving->child > 0 ? waitpid(saving->child, &status, WNOHANG) : -1;
+		if (done == 0) {
+			std::cerr << saving->path << ": checkpoint skipped since the last one is still being written" << std::endl;
+			return;
+		}
+		if (done > 0) report_checkpoint(status);
+		layout file = layout_weights(saving->path); // prepared here, since the child should only make system calls
+		pid_t pid = ::fork();
+		if (pid == 0) _exit(write_weights(file) ? 0 : 1);
+		saving->child = pid > 0 ? pid : 0;
+		if (pid < 0) std::cerr << saving->path << ": checkpoint failed to fork" << std::endl;
+	}
+	// wait for the checkpoint being written (if any)
+	void wait_checkpoint() {
+		if (!saving) return;
+		std::lock_guard<std::mutex> lock(saving->lock);
+		int status = 0;
+		if (saving->child > 0 && waitpid(saving->child, &status, 0) > 0) report_checkpoint(status);
+		saving->child = 0;
+	}
+	// report the checkpoint written by a child, which exits with 1 if the file could not be written
+	void report_checkpoint(int status) const {
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return;
+		std::cerr << saving->path << ": checkpoint failed to be written";
+		if (WIFSIGNALED(status)) std::cerr << " (signal " << WTERMSIG(status) << ")";
+		std::cerr << std::endl;
+	}
+
+	layout layout_weights(const std::string& path) const {
+		layout file;
+		for (const weight& w : net) {
+			file.tables.emplace_back(w, 0);
+			file.values.push_back(w.table());
+		}
+		for (const weight& w : net) { // the accumulators of Temporal Coherence (if any), see allocate_weights
+			if (!w.coherence_table()) continue;
+			file.tables.emplace_back(w, 0, true);
+			file.values.push_back(w.coherence_table());
+		}
+		file.head = file_header(file.tables.size());
+		size_t offset = arena::align(sizeof(file.head) + sizeof(table_header) * file.tables.size());
+		for (table_header& t : file.tables) {
+			t.offset = offset;
+			offset = arena::align(offset + sizeof(weight::type) * t.size);
+		}
+		file.path = path;
+		file.temp = path + ".tmp";
+		return file;
+	}
+	/**
+	 * write the tables to a temporary file by system calls only, and then rename it to the path,
+	 * so that the file at the path is always complete, even if the process crashes while writing
+	 */
+	static bool write_weights(const layout& file) {
+		int fd = ::open(file.temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return false;
+		bool ok = write_all(fd, &file.head, sizeof(file.head), 0);
+		ok = ok && write_all(fd, file.tables.data(), sizeof(table_header) * file.tables.size(), sizeof(file.head));
+		for (size_t i = 0; i < file.tables.size() && ok; i++) { // the gaps between tables are left as zero-filled holes
+			ok = write_all(fd, file.values[i], sizeof(weight::type) * file.tables[i].size, file.tables[i].offset);
+		}
+		ok = ok && fsync(fd) == 0;
+		ok = (close(fd) == 0) && ok;
+		ok = ok && std::rename(file.temp.c_str(), file.path.c_str()) == 0;
+		if (!ok) unlink(file.temp.c_str());
+		return ok;
+	}
+	static bool write_all(int fd, const void* buf, size_t size, off_t offset) {
+		const char* data = static_cast<const char*>(buf);
+		while (size) {
+			ssize_t n = pwrite(fd, data, std::min<size_t>(size, size_t(1) << 30), offset);
+			if (n <= 0) return false;
+			data += n, size -= n, offset += n;
+		}
+		return true;
 	}
 
+	// the indices of the isomorphisms on a board, or on four boards, see weight::indexof
+	typedef size_t index1[weight::iso_level_];
+	typedef size_t index4[weight::iso_level_][4];
+
 	// accumulate the total value of given state
   float estimate(const board &b) const {
-    float value = 0;
-    for (auto& w : net) {
-      value += w.estimate(b);
-    }
-    return value;
+    return estimate(indices(b));
   }
 
+	// accumulate the total value of a state by the indices of all the tables, see indices
+	float estimate(const index1* index) const {
+		float value = 0;
+		for (size_t k = 0; k < net.size(); k++) {
+			value += net[k].estimate(index[k]);
+		}
+		return value;
+	}
+
+	// accumulate the total values of four given states at once
+	void estimate(const board (&b)[4], float (&value)[4]) const {
+		auto index = indices<index4>();
+		for (size_t k = 0; k < net.size(); k++) {
+			net[k].indexof(b, index[k]);
+			net[k].prefetch(index[k]);
+		}
+		std::fill(value, value + 4, 0.0f);
+		for (size_t k = 0; k < net.size(); k++) {
+			net[k].estimate(index[k], value);
+		}
+	}
+
 	// update the value of given state and return its new value
   float update(const board &b, float u) {
+    return update(indices(b), u);
+  }
+
+	/**
+	 * keep the indices of the i-th of the four states last estimated, see estimate,
+	 * so that the state can be updated later without indexing it again
+	 */
+	void keep_indices(unsigned i, std::vector<size_t>& kept) const {
+		auto index = indices<index4>();
+		kept.resize(net.size() * weight::iso_level_);
+		auto keep = reinterpret_cast<index1*>(kept.data());
+		for (size_t k = 0; k < net.size(); k++) {
+			for (size_t j = 0; j < weight::iso_level_; j++) keep[k][j] = index[k][j][i];
+		}
+	}
+
+	// update the value of a state by its kept indices, see keep_indices
+	float update(const std::vector<size_t>& kept, float u) {
+		auto index = reinterpret_cast<const index1*>(kept.data());
+		for (size_t k = 0; k < net.size(); k++) net[k].prefetch(index[k]);
+		return update(index, u);
+	}
+
+	// update the value of a state by the indices of all the tables
+	float update(const index1* index, float u) {
     float u_split = u / net.size();
     float value = 0;
-    for (weight& w : net) {
-      value += w.update(b, u_split);
+    for (size_t k = 0; k < net.size(); k++) {
+      value += net[k].update(index[k], u_split);
     }
     return value;
   }
 
+	/**
+	 * the scratch space for the indices of all the tables in net, where indices<...>()[k] is of the table k
+	 * the space is per thread, so that the threads of a parallel search can estimate with the same agent
+	 */
+	template<typename index> index* indices() const {
+		static thread_local std::vector<size_t> scratch;
+		scratch.resize(net.size() * sizeof(index) / sizeof(size_t));
+		return reinterpret_cast<index*>(scratch.data());
+	}
+
+	// index a state by all the tables into the scratch space, so that it can be estimated and updated once indexed
+	const index1* indices(const board& b) const {
+		auto index = indices<index1>();
+		for (size_t k = 0; k < net.size(); k++) {
+			net[k].indexof(b, index[k]);
+			net[k].prefetch(index[k]);
+		}
+		return index;
+	}
+
 protected:
 	std::vector<weight> net;
+	arena memory;
+	arena compact; // the quantized tables, see quantize_weights
 	float alpha;
+
+	// the state of periodic checkpoints shared by the owner and its workers, see checkpoint_weights
+	struct checkpoint {
+		size_t every = 0;
+		std::string path;
+		std::atomic<size_t> episodes{0};
+		std::mutex lock;
+		pid_t child = 0;
+	};
+	std::shared_ptr<checkpoint> saving;
 };
 
 class td_slider : public weight_agent {
 public:
   td_slider(const std::string &args = "")
       : weight_agent("name=slide role=td_slider " + args) {
-		/// 4-6-tuple *8 
-		auto a = weight({0, 1, 2, 3, 4, 5});
-		net.emplace_back(a);
-		a = weight({4, 5, 6, 7, 8, 9});
-    net.emplace_back(a);
-    // net.emplace_back(weight({0, 1, 2, 4, 5, 6}));
-    // net.emplace_back(weight({4, 5, 6, 8, 9, 10}));
-		a = weight({5, 6, 7, 9, 10, 11});
-		net.emplace_back(a);
-		a = weight({9, 10, 11, 13, 14, 15});
-		net.emplace_back(a);
-
-		/// 8-4-tuple
-		// auto a = weight({0,1,2,3});
-		// net.emplace_back(a);
-		// a = weight({4,5,6,7});
-		// net.emplace_back(a);
-		// a = weight({8, 9, 10, 11});
-		// net.emplace_back(a);
-		// a = weight({12,13,14,15});
-		// net.emplace_back(a);
-		// a = weight({0,4,8,12});
-		// net.emplace_back(a);
-		// a = weight({1,5,9,13});
-		// net.emplace_back(a);
-		// a = weight({2,6,10,14});
-		// net.emplace_back(a);
-		// a = weight({3,7,11,15});
-		// net.emplace_back(a);
+		std::string tuples = "012345,456789,5679ab,9abdef"; // 4-6-tuple *8
+		size_t iso = weight::iso_level_;
+		if (meta.find("init") != meta.end()) {
+			std::cerr << "init= is no longer supported, use tuples= with hexadecimal cells, e.g., tuples=0123,4567" << std::endl;
+			std::exit(-1);
+		}
+		if (meta.find("tuples") != meta.end())
+			tuples = std::string(meta["tuples"]);
+		else if (meta.find("load") != meta.end())
+			read_topology(meta["load"], tuples, iso); // the topology of the weights
+		if (meta.find("iso") != meta.end())
+			iso = int(meta["iso"]);
+		compile_tuples();
+		build_weights(tuples, iso);
 		if (meta.find("load") != meta.end())
       load_weights(meta["load"]);
+		if (meta.find("quant") != meta.end())
+			quantize_weights(meta["quant"]);
+		if (meta.find("online") != meta.end())
+			online = int(meta["online"]);
+		if (meta.find("depth") != meta.end())
+			depth = std::max(int(meta["depth"]), 1);
+		if (meta.find("tt") != meta.end()) // the transposition table of 2^tt entries, e.g., tt=22 for 64 MB
+			cache.resize(int(meta["tt"]));
+		if (meta.find("pool") != meta.end() && int(meta["pool"]) > 1) // the threads of the search, see spawn
+			pool.reset(new task_pool(int(meta["pool"])));
+		if (meta.find("cutoff") != meta.end())
+			cutoff = std::max(int(meta["cutoff"]), 1);
+		if (meta.find("ttleaf") != meta.end()) // also cache the leaves, which rarely pays off, see transposition
+			cache_leaves = int(meta["ttleaf"]);
+		if ((cache.enabled() || cache_leaves) && alpha != 0) { // the cached values are stale once the weights are updated
+			std::cerr << "tt= and ttleaf= are only valid with alpha=0" << std::endl;
+			std::exit(-1);
+		}
+		if (meta.find("budget") != meta.end()) { // per move in milliseconds, deepened up to depth= (default 8)
+			budget = float(meta["budget"]);
+			if (meta.find("depth") == meta.end()) depth = 8;
+		}
+		if (meta.find("lambda") != meta.end())
+			lambda = float(meta["lambda"]);
+		if (meta.find("window") != meta.end())
+			window = std::max(int(meta["window"]), 1);
+		if (lambda != 0) online = true; // the traces are learned online
+		trace.resize(lambda != 0 ? window : 1);
 
 		for(int k=0;k<net.size();k++){
 			std::cout << "net[" << k << "].size(): " << net[k].size() << std::endl;
@@ -192,29 +665,78 @@ public:
 			}
 			std::cout << std::endl;
 		}
-    path_.reserve(20000);
+    if (!online) path_.reserve(20000);
   }
+	/**
+	 * instantiate the common tuples with unrolled indexing, i.e., the 4-6-tuple and the 8-4-tuple,
+	 * other tuples given by the topology use the runtime indexing
+	 */
+	static void compile_tuples() {
+		tuple<0, 1, 2, 3, 4, 5>::instance();
+		tuple<4, 5, 6, 7, 8, 9>::instance();
+		tuple<5, 6, 7, 9, 10, 11>::instance();
+		tuple<9, 10, 11, 13, 14, 15>::instance();
+		tuple<0, 1, 2, 4, 5, 6>::instance();
+		tuple<4, 5, 6, 8, 9, 10>::instance();
+		tuple<0, 1, 2, 3>::instance();
+		tuple<4, 5, 6, 7>::instance();
+		tuple<8, 9, 10, 11>::instance();
+		tuple<12, 13, 14, 15>::instance();
+		tuple<0, 4, 8, 12>::instance();
+		tuple<1, 5, 9, 13>::instance();
+		tuple<2, 6, 10, 14>::instance();
+		tuple<3, 7, 11, 15>::instance();
+	}
+	td_slider(const td_slider& shared) : weight_agent(shared),
+		online(shared.online), lambda(shared.lambda), window(shared.window), trace(shared.trace.size()),
+		depth(shared.depth), budget(shared.budget), cache(shared.cache.bits()), cache_leaves(shared.cache_leaves),
+		pool(shared.pool ? new task_pool(shared.pool->size()) : nullptr), cutoff(shared.cutoff) {
+		if (!online) path_.reserve(20000);
+	}
 	~td_slider() {
-    if (meta.find("save") != meta.end())
-      save_weights(meta["save"]);
+    if (cache.enabled()) cache.show();
+    if (meta.find("save") == meta.end()) return;
+    wait_checkpoint(); // the last checkpoint should not replace the final weights
+    save_weights(meta["save"]);
   }
 
   virtual action take_action(const board &before) {
-    board after[] = {board(before), board(before), board(before),
-                     board(before)};
-    int reward[] = {after[0].slide(0), after[1].slide(1),
-                                after[2].slide(2), after[3].slide(3)};
+		board after[4];
+		board::reward reward[4];
+		before.slide(after, reward);
+		float estimated[4];
+		estimate(after, estimated);
 		constexpr const float ninf = -std::numeric_limits<float>::max();
-		// std::cout << "in take_action2" << estimate(after[0]) << std::endl;																			
-    float value[] = {
-        reward[0] == -1 ? ninf : reward[0] + estimate(after[0]),
-        reward[1] == -1 ? ninf : reward[1] + estimate(after[1]),
-        reward[2] == -1 ? ninf : reward[2] + estimate(after[2]),
-        reward[3] == -1 ? ninf : reward[3] + estimate(after[3]),
-    };
+		float value[] = {
+			reward[0] == -1 ? ninf : reward[0] + estimated[0],
+			reward[1] == -1 ? ninf : reward[1] + estimated[1],
+			reward[2] == -1 ? ninf : reward[2] + estimated[2],
+			reward[3] == -1 ? ninf : reward[3] + estimated[3],
+		};
+		float searched[4];
+		if (depth > 1 || budget > 0) { // select by expectimax, but still learn from the values of the network
+			search(after, reward, searched);
+			if (online) estimate(after, estimated); // for keep_indices, since the search estimated others
+		} else {
+			std::copy(value, value + 4, searched);
+		}
 		// std::cout << "in take_action3" << std::endl;
-    float *max_value = std::max_element(value, value + 4);
+    float *max_value = value + (std::max_element(searched, searched + 4) - searched);
 		// std::cout << "in take_action4" << std::endl;
+    if (online) {
+      if (*max_value > ninf) {
+        unsigned idx = max_value - value;
+        learn_online(*max_value);
+        head = (head + 1) % trace.size();
+        keep_indices(idx, trace[head]);
+        traced = std::min(traced + 1, trace.size());
+        last_value = estimated[idx];
+        return action::slide(idx);
+      }
+      learn_online(0); // the terminal state
+      traced = 0;
+      return action();
+    }
     if (*max_value > ninf) {
       unsigned idx = max_value - value;
 			// std::cout << "in take_action5" << std::endl;
@@ -232,7 +754,139 @@ public:
     return action();
   }
 
+  /**
+   * the expectimax search over the afterstates of a move, where the values of legal moves are
+   * the rewards plus the expected values of the afterstates, see expect, searched for 'depth' moves,
+   * or deepened iteratively until the next depth is predicted to exceed the 'budget' milliseconds
+   */
+  void search(const board (&after)[4], const board::reward (&reward)[4], float (&value)[4]) const {
+    constexpr const float ninf = -std::numeric_limits<float>::max();
+    auto start = std::chrono::steady_clock::now();
+    double last = 0;
+    for (unsigned d = budget > 0 ? std::min(2u, depth) : depth; d <= depth; d++) {
+      spawn(4, d - 1, [&](size_t op) {
+        value[op] = reward[op] == -1 ? ninf : reward[op] + expect(after[op], d - 1);
+      });
+      double used = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      double next = used - last; // the time of this depth, and the next depth is predicted by its growth
+      if (budget > 0 && used + next * (last > 0 ? next / last : 1) > budget) break;
+      last = next;
+    }
+  }
+
+  /**
+   * the expected value of an afterstate over the placements of the placer, see random_placer,
+   * i.e., the positions on the edge opposite to the last slide, and the next hints in the bag,
+   * where the value of each placement is the best move searched 'depth' - 1 moves further
+   */
+  float expect(const board& after, unsigned depth) const {
+    if (depth == 0 || after.hint() == 0) return estimate(after);
+    uint64_t key = 0;
+    float value = 0;
+    if (cache.enabled()) {
+      key = transposition::key(after, transposition::chance);
+      if (cache.find(key, depth, value, transposition::chance)) return value;
+    }
+    value = expected(after, depth);
+    if (cache.enabled()) cache.store(key, depth, value);
+    return value;
+  }
+  float expected(const board& after, unsigned depth) const {
+    board placed[16 * 3];
+    unsigned count[16 * 3]; // the count of the hint in the bag
+    unsigned size = 0, num = 0;
+    for (int pos : random_placer::spaces(after.last())) {
+      if (after(pos) != 0) continue;
+      num++;
+      for (board::cell hint = 1; hint <= 3; hint++) {
+        if (after.bag(hint) == 0) continue;
+        placed[size] = after;
+        placed[size].place(pos, after.hint(), hint);
+        count[size++] = after.bag(hint);
+        // the leaves are evaluated without the hint, so that the next hint only matters for deeper searches
+        if (depth == 1) { count[size - 1] = 0; break; }
+      }
+    }
+    float value[16 * 3];
+    spawn(size, depth, [&](size_t i) { value[i] = best(placed[i], depth); });
+    unsigned bag = after.bag(1) + after.bag(2) + after.bag(3);
+    float sum = 0;
+    for (unsigned i = 0; i < size; i++) sum += count[i] ? value[i] * count[i] / bag : value[i];
+    return num ? sum / num : estimate(after);
+  }
+
+  /**
+   * the value of the best move on a board, where the game is over (valued 0) if no move is legal
+   * the best move of the last depth only depends on the tiles, since the hint is not searched any further
+   */
+  float best(const board& before, unsigned depth) const {
+    if (!cache.enabled() || (depth == 1 && !cache_leaves)) return maximum(before, depth);
+    transposition::kind kind = depth == 1 ? transposition::leaf : transposition::max;
+    uint64_t key = transposition::key(before, kind);
+    float value = 0;
+    if (cache.find(key, depth, value, kind)) return value;
+    value = maximum(before, depth);
+    cache.store(key, depth, value);
+    return value;
+  }
+  float maximum(const board& before, unsigned depth) const {
+    board after[4];
+    board::reward reward[4];
+    before.slide(after, reward);
+    constexpr const float ninf = -std::numeric_limits<float>::max();
+    float value = ninf; // the best move may have a negative value, which is not the same as the game over
+    if (depth == 1) { // the leaves, which are estimated at once
+      float estimated[4];
+      estimate(after, estimated);
+      for (unsigned op = 0; op < 4; op++)
+        if (reward[op] != -1) value = std::max(value, reward[op] + estimated[op]);
+      return value > ninf ? value : 0;
+    }
+    float expected[4];
+    spawn(4, depth - 1, [&](size_t op) { expected[op] = reward[op] != -1 ? expect(after[op], depth - 1) : 0; });
+    for (unsigned op = 0; op < 4; op++)
+      if (reward[op] != -1) value = std::max(value, reward[op] + expected[op]);
+    return value > ninf ? value : 0;
+  }
+
+  /**
+   * run fn(0), fn(1), ..., fn(n - 1) for the subtrees of the given depth, which are run in parallel
+   * by the pool if they are deep enough, i.e., at least 'cutoff', or one by one otherwise
+   */
+  template<typename function>
+  void spawn(size_t n, unsigned depth, const function& fn) const {
+    if (pool && depth >= cutoff) return pool->parallel_for(n, fn);
+    for (size_t i = 0; i < n; i++) fn(i);
+  }
+
+  /**
+   * the online TD(0), which updates the last afterstate toward the reward and the value of
+   * the next afterstate as soon as the next move is selected, i.e., online=1
+   * the last afterstate is updated by its indices kept when it was selected, see keep_indices
+   *
+   * with lambda=, the TD(lambda) with a truncated trace, where the TD error also updates the
+   * 'window' afterstates before the last one, with the error decayed by lambda per step
+   */
+  void learn_online(float target) {
+    if (alpha == 0) return;
+    float error = alpha * (target - last_value);
+    for (size_t k = 0; k < traced; k++, error *= lambda)
+      update(trace[(head + trace.size() - k) % trace.size()], error);
+  }
+
+	// whether the afterstates are learned during the episodes, i.e., online=1 or lambda, see learn_online
+	bool learns_online() const { return online; }
+
+	// the searched values of the old weights are dropped with them
+	virtual void snapshot_weights(const weight_agent& from) {
+		weight_agent::snapshot_weights(from);
+		cache.clear();
+	}
+
   void update_episode() {
+    if (alpha == 0) return path_.clear(); // the tables may be mapped read-only
+    checkpoint_weights();
+    if (online) return void(traced = 0); // already learned during the episode
     float exact = 0;
     for (path_.pop_back(); path_.size(); path_.pop_back()) {
       state &move = path_.back();
@@ -242,51 +896,60 @@ public:
     path_.clear();
   }
 
-private:
-  struct state {
-    board before, after;
-    unsigned op;
-    float reward, value;
-  };
-  std::vector<state> path_;
-};
+	/**
+	 * the afterstates and rewards of an episode, for learning the episode elsewhere, see learn_episode
+	 * where version is the version of the weights that played the episode
+	 */
+	struct trajectory {
+		std::vector<board> after;
+		std::vector<float> reward;
+		size_t version = 0;
+	};
 
-/**
- * default random environment, i.e., placer
- * place the hint tile and decide a new hint tile
- */
-class random_placer : public random_agent {
-public:
-	random_placer(const std::string& args = "") : random_agent("name=place role=placer " + args) {
-		spaces[0] = { 12, 13, 14, 15 };
-		spaces[1] = { 0, 4, 8, 12 };
-		spaces[2] = { 0, 1, 2, 3};
-		spaces[3] = { 3, 7, 11, 15 };
-		spaces[4] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	// move the path of the last episode into the given trajectory
+	void export_episode(trajectory& path) {
+		path.after.clear();
+		path.reward.clear();
+		if (path_.size()) path_.pop_back(); // the terminal state
+		for (const state& move : path_) {
+			path.after.push_back(move.after);
+			path.reward.push_back(move.reward);
+		}
+		path_.clear();
 	}
 
-	virtual action take_action(const board& after) {
-		std::vector<int> space = spaces[after.last()];
-		std::shuffle(space.begin(), space.end(), engine);
-		for (int pos : space) {
-			if (after(pos) != 0) continue;
-
-			int bag[3], num = 0;
-			for (board::cell t = 1; t <= 3; t++)
-				for (size_t i = 0; i < after.bag(t); i++)
-					bag[num++] = t;
-			std::shuffle(bag, bag + num, engine);
-
-			board::cell tile = after.hint() ?: bag[--num];
-			board::cell hint = bag[--num];
-
-			return action::place(pos, tile, hint);
+	// learn an episode played by another agent, which is the same as update_episode
+	void learn_episode(const trajectory& path) {
+		if (alpha == 0) return; // the tables may be mapped read-only
+		checkpoint_weights();
+		float exact = 0;
+		for (size_t i = path.after.size(); i--; ) {
+			const index1* index = indices(path.after[i]); // indexed once for both the estimate and the update
+			float error = exact - estimate(index);
+			exact = path.reward[i] + update(index, alpha * error);
 		}
-		return action();
 	}
 
 private:
-	std::vector<int> spaces[5];
+  struct state {
+    board before, after;
+    unsigned op;
+    float reward, value;
+  };
+  std::vector<state> path_;
+  bool online = false;
+  float lambda = 0;
+  size_t window = 5;
+  std::vector<std::vector<size_t>> trace; // the indices of the last afterstates, see learn_online
+  size_t head = 0; // the newest in trace
+  size_t traced = 0;
+  float last_value = 0;
+  unsigned depth = 1; // the moves searched by expectimax, see search
+  float budget = 0; // the time per move in milliseconds, see search
+  mutable transposition cache; // the values searched, which are only valid while the weights are fixed
+  bool cache_leaves = false;
+  std::unique_ptr<task_pool> pool;
+  unsigned cutoff = 2; // the least depth of the subtrees searched in parallel, see spawn
 };
 
 /**
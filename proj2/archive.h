@@ -0,0 +1,243 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * archive.h: Binary log of episodes for saving and loading statistics
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include "episode.h"
+#include "arena.h"
+
+/**
+ * the binary format of episodes, which is chosen by the extension ".bin", e.g., --save=stats.bin
+ *
+ * the file starts with a header, i.e., the magic "3EPL" and the version (32-bit), followed by the episodes,
+ * each of which is its size in bytes (varint) and its fields, i.e., the open and close tags and wall clocks,
+ * the duration in nanoseconds, the number of moves, and each move as its action, reward, and time (varints)
+ *
+ * the episodes are written one by one as they are recorded (all of them, while the text format keeps the last limit),
+ * and the offsets of all the episodes are appended as an index when the file is closed,
+ * followed by the number of episodes (64-bit) and the magic "3EPI";
+ * a file without the index, e.g., an interrupted run, is still readable by scanning the sizes
+ */
+class archive {
+public:
+	static constexpr uint32_t version = 1;
+
+	// whether a path is for the binary format
+	static bool match(const std::string& path) {
+		return path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+	}
+
+	/**
+	 * a log of episodes opened for writing, which is truncated first
+	 */
+	class writer {
+	public:
+		writer(const std::string& path) : out(path, std::ios::out | std::ios::binary | std::ios::trunc), offset(0) {
+			if (!out.is_open()) {
+				std::cerr << "cannot write to " << path << std::endl;
+				std::exit(-1);
+			}
+			uint32_t ver = version;
+			write(magic_head(), 4);
+			write(&ver, 4);
+		}
+		writer(const writer&) = delete;
+		writer& operator =(const writer&) = delete;
+		~writer() { close(); }
+
+		void append(const episode& ep) {
+			buffer.clear();
+			encode(ep, buffer);
+			index.push_back(offset);
+			std::string size;
+			put(size, buffer.size());
+			write(size.data(), size.size());
+			write(buffer.data(), buffer.size());
+		}
+
+		// write the index and close the file
+		void close() {
+			if (!out.is_open()) return;
+			uint64_t count = index.size();
+			write(index.data(), index.size() * sizeof(uint64_t));
+			write(&count, sizeof(count));
+			write(magic_tail(), 4);
+			out.close();
+		}
+
+	private:
+		void write(const void* data, size_t size) {
+			out.write(static_cast<const char*>(data), size);
+			offset += size;
+		}
+
+		std::ofstream out;
+		uint64_t offset;
+		std::vector<uint64_t> index;
+		std::string buffer;
+	};
+
+	/**
+	 * a log of episodes mapped for reading, where any episode can be decoded by its index
+	 */
+	class reader {
+	public:
+		reader(const std::string& path) {
+			if (!memory.map(path) || memory.size() < 8 || std::memcmp(memory.data(), magic_head(), 4) != 0) {
+				std::cerr << "cannot read episodes from " << path << std::endl;
+				std::exit(-1);
+			}
+			uint32_t ver;
+			std::memcpy(&ver, memory.data() + 4, 4);
+			if (ver != version) {
+				std::cerr << "unsupported version " << ver << " of " << path << std::endl;
+				std::exit(-1);
+			}
+			if (!read_index()) scan_index();
+		}
+
+		size_t size() const { return index.size(); }
+
+		episode at(size_t i) const {
+			const char* p = memory.data() + index.at(i);
+			const char* end = memory.data() + memory.size();
+			size_t size = get(p, end);
+			episode ep;
+			if (!decode(ep, p, std::min(p + size, end))) {
+				std::cerr << "corrupted episode " << i << std::endl;
+				std::exit(-1);
+			}
+			return ep;
+		}
+
+	private:
+		// read the index at the end of the file, return false if there is no valid index
+		bool read_index() {
+			const char* end = memory.data() + memory.size();
+			if (memory.size() < 8 + 12 || std::memcmp(end - 4, magic_tail(), 4) != 0) return false;
+			uint64_t count;
+			std::memcpy(&count, end - 12, sizeof(count));
+			if (count > (memory.size() - 8 - 12) / sizeof(uint64_t)) return false;
+			index.resize(count);
+			std::memcpy(index.data(), end - 12 - count * sizeof(uint64_t), count * sizeof(uint64_t));
+			return true;
+		}
+
+		// find the episodes by their sizes, where an incomplete episode at the end is ignored
+		void scan_index() {
+			index.clear();
+			const char* begin = memory.data();
+			const char* end = begin + memory.size();
+			for (const char* p = begin + 8; p < end; ) {
+				const char* head = p;
+				size_t size = get(p, end);
+				if (p == end || size > size_t(end - p)) break;
+				index.push_back(head - begin);
+				p += size;
+			}
+		}
+
+		arena memory;
+		std::vector<uint64_t> index;
+	};
+
+private:
+	static const char* magic_head() { return "3EPL"; }
+	static const char* magic_tail() { return "3EPI"; }
+
+	static void put(std::string& out, uint64_t v) {
+		for (; v >= 0x80; v >>= 7) out.push_back(char(v | 0x80));
+		out.push_back(char(v));
+	}
+	static void put(std::string& out, const std::string& s) {
+		put(out, s.size());
+		out.append(s);
+	}
+	// read a varint, where p is moved to the end if the varint is truncated
+	static uint64_t get(const char*& p, const char* end) {
+		uint64_t v = 0;
+		for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+			uint8_t b = *p++;
+			v |= uint64_t(b & 0x7f) << shift;
+			if (!(b & 0x80)) return v;
+		}
+		p = end;
+		return v;
+	}
+	static bool get(const char*& p, const char* end, std::string& s) {
+		size_t size = get(p, end);
+		if (size > size_t(end - p)) return false;
+		s.assign(p, size);
+		p += size;
+		return true;
+	}
+
+	/**
+	 * a move is packed as (event << 3) | (reward != 0) << 2 | kind, where kind is 0 for slides, 1 for places,
+	 * or 2 for other actions, whose codes follow; then the reward if it is not zero, and the time
+	 */
+	static void encode(const episode& ep, std::string& out) {
+		put(out, ep.ep_open.tag);
+		put(out, ep.ep_open.when);
+		put(out, ep.ep_close.tag);
+		put(out, ep.ep_close.when);
+		put(out, ep.ep_close.ticks - ep.ep_open.ticks);
+		put(out, ep.ep_moves.size());
+		for (const episode::move& mv : ep.ep_moves) {
+			action a = mv.code;
+			unsigned rewarded = mv.reward ? 4 : 0;
+			if (a.type() == action::slide::type) {
+				put(out, a.event() << 3 | rewarded | 0);
+			} else if (a.type() == action::place::type) {
+				put(out, a.event() << 3 | rewarded | 1);
+			} else {
+				put(out, rewarded | 2);
+				put(out, unsigned(a));
+			}
+			if (rewarded) put(out, mv.reward);
+			put(out, mv.time);
+		}
+	}
+
+	// decode an episode and replay its moves, return false if the data is corrupted
+	static bool decode(episode& ep, const char* p, const char* end) {
+		std::string open, close;
+		if (!get(p, end, open)) return false;
+		time_t opened = get(p, end);
+		if (!get(p, end, close)) return false;
+		time_t closed = get(p, end);
+		time_t duration = get(p, end);
+		size_t moves = get(p, end);
+		if (moves > size_t(end - p)) return false;
+		ep.ep_open = { open, opened };
+		ep.ep_close = { close, closed, ep.ep_open.ticks + duration };
+		ep.ep_moves.reserve(moves);
+		for (size_t i = 0; i < moves; i++) {
+			if (p >= end) return false;
+			uint64_t code = get(p, end);
+			bool rewarded = code & 4;
+			switch (code & 3) {
+			case 0: code = action::slide::type | (code >> 3); break;
+			case 1: code = action::place::type | (code >> 3); break;
+			default: code = get(p, end); break;
+			}
+			board::reward reward = rewarded ? get(p, end) : 0;
+			time_t time = get(p, end);
+			ep.ep_moves.emplace_back(action(code), reward, time);
+			if (action(code).apply(ep.ep_state) != reward) return false; // an illegal move, see episode::verify
+			ep.ep_score += reward;
+		}
+		return p == end; // an episode is exactly its size
+	}
+};
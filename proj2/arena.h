@@ -0,0 +1,108 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * arena.h: Contiguous page-aligned memory for the weight tables
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * a single mapping which holds all the weight tables
+ *
+ * an anonymous mapping is zero-filled by the kernel, so a fresh network costs no copies;
+ * with huge pages, the mapping is aligned to 2 MB and advised as MADV_HUGEPAGE,
+ * so that random lookups over hundreds of MB stay within a few TLB entries
+ *
+ * a file mapping is read-only and shared, so that processes evaluating the same
+ * weights share one copy in the page cache and start without reading the file
+ */
+class arena {
+public:
+	static constexpr size_t page_size = size_t(4) << 10;
+	static constexpr size_t huge_page_size = size_t(2) << 20;
+
+public:
+	arena() : base(nullptr), length(0), head(nullptr), span(0) {}
+	arena(size_t size, bool huge = true) : arena() { allocate(size, huge); }
+	arena(arena&& a) : arena() { swap(a); }
+	arena& operator =(arena&& a) { swap(a); return *this; }
+	arena(const arena&) = delete;
+	arena& operator =(const arena&) = delete;
+	~arena() { release(); }
+
+	char* data() { return base; }
+	const char* data() const { return base; }
+	size_t size() const { return length; }
+
+	static size_t align(size_t size, size_t unit = page_size) { return (size + unit - 1) / unit * unit; }
+
+public:
+	/**
+	 * map a zero-filled region of at least the given size, the old region (if any) is released
+	 * throw std::bad_alloc if the region cannot be mapped
+	 */
+	void allocate(size_t size, bool huge = true) {
+		release();
+		if (size == 0) return;
+		size_t unit = huge ? huge_page_size : page_size;
+		length = align(size, unit);
+		span = length + (huge ? unit : 0);
+		void* mem = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) throw std::bad_alloc();
+		head = static_cast<char*>(mem);
+		base = reinterpret_cast<char*>(align(reinterpret_cast<uintptr_t>(head), unit));
+#if defined(MADV_HUGEPAGE)
+		if (huge) madvise(base, length, MADV_HUGEPAGE);
+#endif
+	}
+
+	/**
+	 * map a file as a read-only region shared with other processes, the old region (if any) is released
+	 * return false if the file cannot be mapped, in which case the old region is kept
+	 */
+	bool map(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		void* mem = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+			mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) return false;
+		release();
+		base = head = static_cast<char*>(mem);
+		length = span = st.st_size;
+		return true;
+	}
+
+	void release() {
+		if (head) munmap(head, span);
+		base = head = nullptr;
+		length = span = 0;
+	}
+
+	void swap(arena& a) {
+		std::swap(base, a.base);
+		std::swap(length, a.length);
+		std::swap(head, a.head);
+		std::swap(span, a.span);
+	}
+
+private:
+	char* base; // the aligned region for the tables
+	size_t length;
+	char* head; // the whole mapping, including the alignment padding
+	size_t span;
+};
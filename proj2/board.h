@@ -11,11 +11,35 @@
 #include <array>
 #include <iostream>
 #include <iomanip>
+#include <iterator>
+#include <functional>
 #include <algorithm>
-#include <cmath>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 
 /**
- * array-based board for Threes!
+ * compile-time conversion of tile indices, i.e., (0, 1, 2, 3, 4, 5, ...)
+ * to the tiles (0, 1, 2, 3, 6, 12, ...) and to their scores (0, 0, 0, 3, 9, 27, ...)
+ */
+struct tile_index {
+	static constexpr unsigned tile(unsigned i) { return i >= 3 ? 3u << (i - 3) : i; }
+	static constexpr unsigned value(unsigned i) { return i >= 3 ? 3 * value(i - 1) + (i == 3) * 3 : 0; }
+	template<unsigned... i> struct table;
+};
+
+template<unsigned... i> struct tile_index::table {
+	static constexpr unsigned tile[sizeof...(i)] = { tile_index::tile(i)... };
+	static constexpr unsigned value[sizeof...(i)] = { tile_index::value(i)... };
+#if defined(__SSSE3__)
+	static __m128i plane(unsigned shift) { return _mm_setr_epi8(char(tile_index::value(i) >> shift)...); }
+#endif
+};
+template<unsigned... i> constexpr unsigned tile_index::table<i...>::tile[sizeof...(i)];
+template<unsigned... i> constexpr unsigned tile_index::table<i...>::value[sizeof...(i)];
+
+/**
+ * bitboard for Threes!, each tile index is packed into a 4-bit cell
  *
  * index (1-d form):
  *  (0)  (1)  (2)  (3)
@@ -23,6 +47,9 @@
  *  (8)  (9) (10) (11)
  * (12) (13) (14) (15)
  *
+ * the cell (i) occupies bits [4i, 4i + 4) of the 64-bit tile data, i.e.,
+ * the row (r) is the 16-bit word at bits [16r, 16r + 16)
+ *
  */
 class board {
 public:
@@ -33,37 +60,52 @@ public:
 	typedef uint64_t score;
 	typedef int reward;
 
+	class reference; // writable proxy of a 4-bit cell
+	class iterator; // read-only iterator over the 16 cells
+
 public:
-	board() : tile(), attr(0) { reset(); }
-	board(const grid& b, data v = 0) : tile(b), attr(v) {}
+	board() : tile(0), attr(0) { reset(); }
+	board(const grid& b, data v = 0) : tile(0), attr(v) {
+		for (int i = 0; i < 16; i++) put(i, b[i / 4][i % 4]);
+	}
+	explicit board(data t, data v = 0) : tile(t), attr(v) {}
 	board(const board& b) = default;
 	board& operator =(const board& b) = default;
 
-	operator grid&() { return tile; }
-	operator const grid&() const { return tile; }
-	row& operator [](unsigned i) { return tile[i]; }
-	const row& operator [](unsigned i) const { return tile[i]; }
-	cell& operator ()(unsigned i) { return tile[i / 4][i % 4]; }
-	const cell& operator ()(unsigned i) const { return tile[i / 4][i % 4]; }
+	operator grid() const {
+		grid g;
+		for (int i = 0; i < 16; i++) g[i / 4][i % 4] = at(i);
+		return g;
+	}
+	row operator [](unsigned i) const { return {{ at(i * 4 + 0), at(i * 4 + 1), at(i * 4 + 2), at(i * 4 + 3) }}; }
+	reference operator ()(unsigned i);
+	cell operator ()(unsigned i) const { return at(i); }
 
-	cell* begin() { return &(operator()(0)); }
-	const cell* begin() const { return &(operator()(0)); }
-	cell* end() { return begin() + 16; }
-	const cell* end() const { return begin() + 16; }
+	iterator begin() const;
+	iterator end() const;
 
+	data raw() const { return tile; }
+	data raw(data t) { data old = tile; tile = t; return old; }
 	data info() const { return attr; }
 	data info(data dat) { data old = attr; attr = dat; return old; }
 
 private:
+	cell at(unsigned i) const { return (tile >> (i << 2)) & 0x0fu; }
+	void put(unsigned i, cell t) { tile = (tile & ~(data(0x0fu) << (i << 2))) | (data(t & 0x0fu) << (i << 2)); }
+
 	data info4(size_t i) const { return (info() >> (4 * i)) & 0x0fu; }
 	data info4(size_t i, data dat) { data old = info4(i); info(info() ^ ((old ^ dat) << (4 * i))); return old; }
 
 public:
-	static unsigned itot(unsigned i) { return i >= 3 ? 3 * (1 << (i - 3)) : i; }
-	static unsigned ttoi(unsigned t) { return t >= 3 ? std::log2(t / 3) + 3 : t; }
-	static unsigned itov(unsigned i) { return ttov(itot(i)); }
-	static unsigned ttov(unsigned t) { return t >= 3 ? std::pow(3, std::log2(t / 3) + 1) : 0; }
+	static unsigned itot(unsigned i) { return tiles::tile[i]; }
+	static constexpr unsigned ttoi(unsigned t) { return t >= 3 ? 34 - __builtin_clz(t / 3) : t; }
+	static unsigned itov(unsigned i) { return tiles::value[i]; }
+	static unsigned ttov(unsigned t) { return itov(ttoi(t)); }
+
+private:
+	typedef tile_index::table<0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15> tiles;
 
+public:
 	cell hint() const { return info4(0); }
 	cell hint(cell t) { return info4(0, t); }
 	unsigned last() const { return info4(1); }
@@ -87,9 +129,21 @@ public:
 		return true;
 	}
 	unsigned value() const {
+#if defined(__SSSE3__)
+		// spread the 16 cells into 16 bytes, then look up the 3 bytes of their scores in parallel
+		const __m128i mask = _mm_set1_epi8(0x0f);
+		__m128i raw = _mm_cvtsi64_si128(tile);
+		__m128i idx = _mm_and_si128(_mm_unpacklo_epi8(raw, _mm_srli_epi16(raw, 4)), mask);
+		__m128i lo = _mm_sad_epu8(_mm_shuffle_epi8(tiles::plane(0), idx), _mm_setzero_si128());
+		__m128i mi = _mm_sad_epu8(_mm_shuffle_epi8(tiles::plane(8), idx), _mm_setzero_si128());
+		__m128i hi = _mm_sad_epu8(_mm_shuffle_epi8(tiles::plane(16), idx), _mm_setzero_si128());
+		__m128i sum = _mm_add_epi64(_mm_add_epi64(lo, _mm_slli_epi64(mi, 8)), _mm_slli_epi64(hi, 16));
+		return _mm_cvtsi128_si64(_mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum)));
+#else
 		score v = 0;
-		for (cell t : *this) v += board::itov(t);
+		for (int i = 0; i < 16; i++) v += board::itov(at(i));
 		return v;
+#endif
 	}
 
 public:
@@ -108,11 +162,11 @@ public:
 	 */
 	reward place(unsigned pos, cell tile, cell hint_tile) {
 		data bak = info();
-		if (pos >= 16 || operator()(pos)) return -1;
+		if (pos >= 16 || at(pos)) return -1;
 		if (hint() == 0 && !extract_hint_from_bag(tile)) return -1;
 		if (hint() != tile) return info(bak), -1;
 		if (!extract_hint_from_bag(hint_tile)) return info(bak), -1;
-		operator()(pos) = tile;
+		put(pos, tile);
 		last(4);
 		return itov(tile);
 	}
@@ -133,47 +187,38 @@ public:
 		return r;
 	}
 
-	reward slide_left() {
-		bool moved = false;
-		reward score = 0;
-		for (int r = 0; r < 4; r++) {
-			auto& row = tile[r];
-			for (int c = 1; c < 4; c++) {
-				auto& t0 = row[c - 1];
-				auto& t1 = row[c];
-				if (t0 == 0) {
-					t0 = t1;
-					t1 = 0;
-					moved |= (t0 != 0);
-				} else if (t1 != 0 && ((t0 + t1 == 3) || (t0 == t1 && t0 >= 3 && t0 < 14))) {
-					t0 = std::max(t0, t1) + 1;
-					t1 = 0;
-					score += itov(t0) - itov(t0 - 1) * 2;
-					moved = true;
-				}
-			}
+	/**
+	 * apply all four sliding actions to copies of the board at once
+	 * store the afterstates and the rewards (-1 for illegal actions) in the URDL order
+	 */
+	void slide(board (&after)[4], reward (&score)[4]) const {
+		data rows = tile, cols = transpose(tile);
+		const lookup* r[] = { &lookup::find(rows), &lookup::find(rows >> 16), &lookup::find(rows >> 32), &lookup::find(rows >> 48) };
+		const lookup* c[] = { &lookup::find(cols), &lookup::find(cols >> 16), &lookup::find(cols >> 32), &lookup::find(cols >> 48) };
+		data res[] = {
+			transpose(data(c[0]->left) | (data(c[1]->left) << 16) | (data(c[2]->left) << 32) | (data(c[3]->left) << 48)),
+			data(r[0]->right) | (data(r[1]->right) << 16) | (data(r[2]->right) << 32) | (data(r[3]->right) << 48),
+			transpose(data(c[0]->right) | (data(c[1]->right) << 16) | (data(c[2]->right) << 32) | (data(c[3]->right) << 48)),
+			data(r[0]->left) | (data(r[1]->left) << 16) | (data(r[2]->left) << 32) | (data(r[3]->left) << 48),
+		};
+		reward gain[] = {
+			reward(c[0]->left_score + c[1]->left_score + c[2]->left_score + c[3]->left_score),
+			reward(r[0]->right_score + r[1]->right_score + r[2]->right_score + r[3]->right_score),
+			reward(c[0]->right_score + c[1]->right_score + c[2]->right_score + c[3]->right_score),
+			reward(r[0]->left_score + r[1]->left_score + r[2]->left_score + r[3]->left_score),
+		};
+		for (unsigned op = 0; op < 4; op++) {
+			after[op] = board(res[op], attr);
+			score[op] = res[op] != tile ? gain[op] : -1;
+			if (score[op] != -1) after[op].last(op);
 		}
-		return (moved) ? score : -1;
-	}
-	reward slide_right() {
-		reflect_horizontal();
-		reward score = slide_left();
-		reflect_horizontal();
-		return score;
-	}
-	reward slide_up() {
-		rotate_clockwise();
-		reward score = slide_right();
-		rotate_counterclockwise();
-		return score;
-	}
-	reward slide_down() {
-		rotate_clockwise();
-		reward score = slide_left();
-		rotate_counterclockwise();
-		return score;
 	}
 
+	reward slide_left() { return slide_rows<&lookup::left, &lookup::left_score>(tile); }
+	reward slide_right() { return slide_rows<&lookup::right, &lookup::right_score>(tile); }
+	reward slide_up() { return slide_columns<&lookup::left, &lookup::left_score>(); }
+	reward slide_down() { return slide_columns<&lookup::right, &lookup::right_score>(); }
+
 	void rotate(int clockwise_count = 1) {
 		switch (((clockwise_count % 4) + 4) % 4) {
 		default:
@@ -189,32 +234,98 @@ public:
 	void reverse() { reflect_horizontal(); reflect_vertical(); }
 
 	void reflect_horizontal() {
-		for (int r = 0; r < 4; r++) {
-			std::swap(tile[r][0], tile[r][3]);
-			std::swap(tile[r][1], tile[r][2]);
-		}
+		tile = ((tile & 0x000f000f000f000full) << 12) | ((tile & 0x00f000f000f000f0ull) << 4)
+		     | ((tile & 0x0f000f000f000f00ull) >> 4) | ((tile & 0xf000f000f000f000ull) >> 12);
 	}
 
 	void reflect_vertical() {
-		for (int c = 0; c < 4; c++) {
-			std::swap(tile[0][c], tile[3][c]);
-			std::swap(tile[1][c], tile[2][c]);
-		}
+		tile = ((tile & 0x000000000000ffffull) << 48) | ((tile & 0x00000000ffff0000ull) << 16)
+		     | ((tile & 0x0000ffff00000000ull) >> 16) | ((tile & 0xffff000000000000ull) >> 48);
+	}
+
+	void transpose() { tile = transpose(tile); }
+
+private:
+	static data transpose(data t) {
+		t = (t & 0xf0f00f0ff0f00f0full) | ((t & 0x0000f0f00000f0f0ull) << 12) | ((t & 0x0f0f00000f0f0000ull) >> 12);
+		t = (t & 0xff00ff0000ff00ffull) | ((t & 0x00000000ff00ff00ull) << 24) | ((t & 0x00ff00ff00000000ull) >> 24);
+		return t;
 	}
 
-	void transpose() {
-		for (int r = 0; r < 4; r++) {
-			for (int c = r + 1; c < 4; c++) {
-				std::swap(tile[r][c], tile[c][r]);
+	/**
+	 * the sliding results of every possible 16-bit row
+	 * note that a row is moved if and only if its result differs from itself
+	 */
+	struct lookup {
+		uint16_t left, right; // the row after sliding left or right
+		uint32_t left_score, right_score; // the reward of sliding left or right
+
+		static const lookup& find(uint16_t row) {
+			static const std::array<lookup, 65536> cache = build();
+			return cache[row];
+		}
+
+		static std::array<lookup, 65536> build() {
+			std::array<lookup, 65536> cache;
+			for (uint32_t row = 0; row < 65536; row++) {
+				uint32_t rev = reverse(row);
+				cache[row].left_score = slide_row(row, cache[row].left);
+				cache[row].right_score = slide_row(rev, cache[row].right);
+				cache[row].right = reverse(cache[row].right);
 			}
+			return cache;
+		}
+		static uint16_t reverse(uint32_t row) {
+			return ((row & 0x000f) << 12) | ((row & 0x00f0) << 4) | ((row & 0x0f00) >> 4) | ((row & 0xf000) >> 12);
 		}
+		static uint32_t slide_row(uint32_t raw, uint16_t& res) {
+			cell row[4] = { raw & 0x0f, (raw >> 4) & 0x0f, (raw >> 8) & 0x0f, (raw >> 12) & 0x0f };
+			uint32_t score = 0;
+			for (int c = 1; c < 4; c++) {
+				auto& t0 = row[c - 1];
+				auto& t1 = row[c];
+				if (t0 == 0) {
+					t0 = t1;
+					t1 = 0;
+				} else if (t1 != 0 && ((t0 + t1 == 3) || (t0 == t1 && t0 >= 3 && t0 < 14))) {
+					t0 = std::max(t0, t1) + 1;
+					t1 = 0;
+					score += itov(t0) - itov(t0 - 1) * 2;
+				}
+			}
+			res = row[0] | (row[1] << 4) | (row[2] << 8) | (row[3] << 12);
+			return score;
+		}
+	};
+
+	/**
+	 * slide all four rows of the given tile data by looking up the row tables
+	 * return the reward, or -1 if nothing is moved
+	 */
+	template<uint16_t lookup::*result, uint32_t lookup::*gain>
+	static reward slide_rows(data& t) {
+		const lookup& r0 = lookup::find(t >>  0);
+		const lookup& r1 = lookup::find(t >> 16);
+		const lookup& r2 = lookup::find(t >> 32);
+		const lookup& r3 = lookup::find(t >> 48);
+		data res = (data(r0.*result) << 0) | (data(r1.*result) << 16) | (data(r2.*result) << 32) | (data(r3.*result) << 48);
+		if (res == t) return -1;
+		t = res;
+		return r0.*gain + r1.*gain + r2.*gain + r3.*gain;
+	}
+	template<uint16_t lookup::*result, uint32_t lookup::*gain>
+	reward slide_columns() {
+		data t = transpose(tile);
+		reward score = slide_rows<result, gain>(t);
+		if (score != -1) tile = transpose(t);
+		return score;
 	}
 
 public:
 	friend std::ostream& operator <<(std::ostream& out, const board& b) {
 		out << "+------------------------+" << std::endl;
 		for (int i = 0; i < 4; i++) {
-			auto& row = b[i];
+			auto row = b[i];
 			out << "|" << std::dec;
 			for (auto t : row) out << std::setw(6) << itot(t);
 			// for (auto t : row) out << std::setw(6) << t; // CS: 我把上面註解掉變成下面這樣
@@ -231,13 +342,59 @@ public:
 	friend std::istream& operator >>(std::istream& in, board& b) {
 		for (int i = 0; i < 16; i++) {
 			while (!std::isdigit(in.peek()) && in.good()) in.ignore(1);
-			in >> b(i);
-			b(i) = ttoi(b(i));
+			cell t = 0;
+			in >> t;
+			b.put(i, ttoi(t));
 		}
 		return in;
 	}
 
 private:
-	grid tile;
+	data tile; // (cell 15:4-bit) ... (cell 1:4-bit) (cell 0:4-bit)
 	data attr; // (#3-tile:4-bit) (#2-tile:4-bit) (#1-tile:4-bit) (last_action:4-bit) (hint_tile:4-bit)
 };
+
+class board::reference {
+public:
+	reference(board& b, unsigned i) : b(b), i(i) {}
+	operator cell() const { return b.at(i); }
+	reference& operator =(cell t) { b.put(i, t); return *this; }
+	reference& operator =(const reference& r) { return operator =(cell(r)); }
+private:
+	board& b;
+	unsigned i;
+};
+
+class board::iterator {
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef cell value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const cell* pointer;
+	typedef cell reference;
+
+	iterator(const board* b = nullptr, unsigned i = 0) : b(b), i(i) {}
+	cell operator *() const { return b->at(i); }
+	iterator& operator ++() { i++; return *this; }
+	iterator operator ++(int) { iterator it = *this; i++; return it; }
+	bool operator ==(const iterator& it) const { return i == it.i && b == it.b; }
+	bool operator !=(const iterator& it) const { return !(*this == it); }
+private:
+	const board* b;
+	unsigned i;
+};
+
+inline board::reference board::operator ()(unsigned i) { return reference(*this, i); }
+inline board::iterator board::begin() const { return iterator(this, 0); }
+inline board::iterator board::end() const { return iterator(this, 16); }
+
+namespace std {
+template<> struct hash<board> {
+	size_t operator ()(const board& b) const {
+		board::data x = b.raw(); // splitmix64 finalizer
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+};
+}
@@ -15,13 +15,24 @@
 #include <sstream>
 #include <chrono>
 #include <numeric>
+#include <mutex>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 
 class episode {
+	friend class archive; // the binary format, see archive.h
 public:
-	episode() : ep_state(initial_state()), ep_score(0), ep_time(0) { ep_moves.reserve(10000); }
+	/**
+	 * the buffer of moves is taken from a shared pool, and is given back when the episode is destroyed,
+	 * so that a buffer only grows with the actual length of games, and is reused by later episodes
+	 */
+	episode() : ep_state(initial_state()), ep_score(0), ep_moves(buffers().take()), ep_time(0) {}
+	episode(const episode&) = default;
+	episode(episode&&) = default;
+	episode& operator =(const episode&) = default;
+	episode& operator =(episode&&) = default;
+	~episode() { buffers().give(std::move(ep_moves)); }
 
 public:
 	board& state() { return ep_state; }
@@ -29,20 +40,20 @@ public:
 	board::score score() const { return ep_score; }
 
 	void open_episode(const std::string& tag) {
-		ep_open = { tag, millisec() };
+		ep_open = { tag, millisec(), nanosec() };
 	}
 	void close_episode(const std::string& tag) {
-		ep_close = { tag, millisec() };
+		ep_close = { tag, millisec(), nanosec() };
 	}
 	bool apply_action(action move) {
 		board::reward reward = move.apply(state());
 		if (reward == -1) return false;
-		ep_moves.emplace_back(move, reward, millisec() - ep_time);
+		ep_moves.emplace_back(move, reward, nanosec() - ep_time);
 		ep_score += reward;
 		return true;
 	}
 	agent& take_turns(agent& slide, agent& place) {
-		ep_time = millisec();
+		ep_time = nanosec();
 		return step() >= 9 && (step() - 8) % 2 ? slide : place;
 	}
 	agent& last_turns(agent& slide, agent& place) {
@@ -59,22 +70,31 @@ public:
 		}
 	}
 
+	/**
+	 * the time of the episode, or the time taken by the moves of an agent, in nanoseconds
+	 */
 	time_t time(unsigned who = -1u) const {
+		if (who != action::slide::type && who != action::place::type) return ep_close.ticks - ep_open.ticks;
 		time_t time = 0;
+		each_time(who, [&](time_t t) { time += t; });
+		return time;
+	}
+
+	/**
+	 * call fn with the time taken by each move of an agent, in nanoseconds
+	 */
+	template<typename function>
+	void each_time(unsigned who, const function& fn) const {
 		size_t i = 9;
 		switch (who) {
 		case action::place::type:
 			if (ep_moves.size())
-				for (i = 0; i < 8; i++) time += ep_moves[i].time;
+				for (i = 0; i < 8; i++) fn(ep_moves[i].time);
 			// no break;
 		case action::slide::type:
-			while (i < ep_moves.size()) time += ep_moves[i].time, i += 2;
-			break;
-		default:
-			time = ep_close.when - ep_open.when;
+			while (i < ep_moves.size()) fn(ep_moves[i].time), i += 2;
 			break;
 		}
-		return time;
 	}
 
 	std::vector<action> actions(unsigned who = -1u) const {
@@ -95,6 +115,18 @@ public:
 		return res;
 	}
 
+	/**
+	 * replay the moves from the initial state, and return the index of the first move which is illegal
+	 * or does not give its recorded reward, i.e., the number of moves if the episode is valid
+	 */
+	size_t verify() const {
+		board state = initial_state();
+		for (size_t i = 0; i < ep_moves.size(); i++) {
+			if (action(ep_moves[i]).apply(state) != ep_moves[i].reward) return i;
+		}
+		return ep_moves.size();
+	}
+
 public:
 
 	friend std::ostream& operator <<(std::ostream& out, const episode& ep) {
@@ -103,19 +135,24 @@ public:
 		out << '|' << ep.ep_close;
 		return out;
 	}
+	// the failbit is set if a move is invalid, see verify
 	friend std::istream& operator >>(std::istream& in, episode& ep) {
 		ep = {};
 		std::string token;
 		std::getline(in, token, '|');
 		std::stringstream(token) >> ep.ep_open;
 		std::getline(in, token, '|');
+		bool valid = true;
 		for (std::stringstream moves(token); !moves.eof(); moves.peek()) {
 			ep.ep_moves.emplace_back();
 			moves >> ep.ep_moves.back();
-			ep.ep_score += action(ep.ep_moves.back()).apply(ep.ep_state);
+			board::reward reward = action(ep.ep_moves.back()).apply(ep.ep_state);
+			valid = valid && reward == ep.ep_moves.back().reward;
+			ep.ep_score += reward;
 		}
 		std::getline(in, token, '|');
 		std::stringstream(token) >> ep.ep_close;
+		if (!valid) in.setstate(std::ios::failbit);
 		return in;
 	}
 
@@ -131,7 +168,7 @@ protected:
 		friend std::ostream& operator <<(std::ostream& out, const move& m) {
 			out << m.code;
 			if (m.reward) out << '[' << std::dec << m.reward << ']';
-			if (m.time) out << '(' << std::dec << m.time << ')';
+			if (m.time >= 1000000) out << '(' << std::dec << m.time / 1000000 << ')'; // in milliseconds
 			return out;
 		}
 		friend std::istream& operator >>(std::istream& in, move& m) {
@@ -146,22 +183,54 @@ protected:
 			if (in.peek() == '(') {
 				in.ignore(1);
 				in >> std::dec >> m.time;
+				m.time *= 1000000;
 				in.ignore(1);
 			}
 			return in;
 		}
 	};
 
+	/**
+	 * the spare buffers of moves, which are shared by all threads
+	 */
+	class move_pool {
+	public:
+		std::vector<move> take() {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (spare.empty()) return {};
+			std::vector<move> moves = std::move(spare.back());
+			spare.pop_back();
+			return moves;
+		}
+		void give(std::vector<move>&& moves) {
+			if (moves.capacity() == 0) return;
+			moves.clear();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (spare.size() < 64) spare.push_back(std::move(moves));
+		}
+	private:
+		std::mutex mutex;
+		std::vector<std::vector<move>> spare;
+	};
+	static move_pool& buffers() {
+		static move_pool pool;
+		return pool;
+	}
+
 	struct meta {
 		std::string tag;
-		time_t when;
-		meta(const std::string& tag = "N/A", time_t when = 0) : tag(tag), when(when) {}
+		time_t when; // the wall clock in milliseconds, which is saved
+		time_t ticks; // the monotonic clock in nanoseconds, which is only for durations
+		meta(const std::string& tag = "N/A", time_t when = 0) : tag(tag), when(when), ticks(when * 1000000) {}
+		meta(const std::string& tag, time_t when, time_t ticks) : tag(tag), when(when), ticks(ticks) {}
 
 		friend std::ostream& operator <<(std::ostream& out, const meta& m) {
 			return out << m.tag << "@" << std::dec << m.when;
 		}
 		friend std::istream& operator >>(std::istream& in, meta& m) {
-			return std::getline(in, m.tag, '@') >> std::dec >> m.when;
+			std::getline(in, m.tag, '@') >> std::dec >> m.when;
+			m.ticks = m.when * 1000000;
+			return in;
 		}
 	};
 
@@ -172,6 +241,10 @@ protected:
 		auto now = std::chrono::system_clock::now().time_since_epoch();
 		return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
 	}
+	static time_t nanosec() {
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+	}
 
 private:
 	board ep_state;
@@ -0,0 +1,131 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * pool.h: Work-stealing thread pool for the parallel search
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+/**
+ * a pool of threads, each of which has its own deque of tasks
+ *
+ * a thread pushes and pops its own tasks at the back, and steals the tasks of others at the front,
+ * so that the oldest tasks, i.e., the largest subtrees of a search, are the ones moved between threads
+ *
+ * the thread which calls parallel_for runs the tasks as well while waiting, so that the tasks may
+ * call parallel_for recursively without blocking the pool; idle workers sleep until tasks are pushed
+ */
+class task_pool {
+public:
+	task_pool(size_t threads) : queues(std::max<size_t>(threads, 1)), queued(0), stop(false) {
+		for (size_t i = 1; i < queues.size(); i++) workers.emplace_back(&task_pool::work, this, i);
+	}
+	task_pool(const task_pool&) = delete;
+	task_pool& operator =(const task_pool&) = delete;
+	~task_pool() {
+		{
+			std::lock_guard<std::mutex> lock(idle);
+			stop = true;
+		}
+		wakeup.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	size_t size() const { return queues.size(); }
+
+public:
+	/**
+	 * run fn(0), fn(1), ..., fn(n - 1) in parallel, and return after all of them are done
+	 */
+	template<typename function>
+	void parallel_for(size_t n, const function& fn) {
+		if (n == 0) return;
+		std::atomic<size_t> pending(n - 1);
+		size_t self = slot();
+		for (size_t i = 1; i < n; i++) push(self, [&fn, &pending, i]() { fn(i); pending--; });
+		fn(0);
+		while (pending.load() != 0) {
+			if (!run(self)) std::this_thread::yield();
+		}
+	}
+
+private:
+	typedef std::function<void()> task;
+
+	void push(size_t self, task&& t) {
+		queued++;
+		{
+			std::lock_guard<std::mutex> lock(queues[self].lock);
+			queues[self].tasks.push_back(std::move(t));
+		}
+		{ std::lock_guard<std::mutex> lock(idle); } // so that a worker either sees the task or is already waiting
+		wakeup.notify_one();
+	}
+
+	// run a task of its own, or a task stolen from others, return false if there is none
+	bool run(size_t self) {
+		task t;
+		for (size_t k = 0; k < queues.size() && !t; k++) {
+			queue& q = queues[(self + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(q.lock);
+			if (q.tasks.empty()) continue;
+			if (k == 0) {
+				t = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			} else {
+				t = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+		}
+		if (!t) return false;
+		queued--;
+		t();
+		return true;
+	}
+
+	void work(size_t self) {
+		current() = { this, self };
+		while (true) {
+			if (run(self)) continue;
+			std::unique_lock<std::mutex> lock(idle);
+			wakeup.wait(lock, [this]() { return queued.load() != 0 || stop; });
+			if (stop) return;
+		}
+	}
+
+	// the slot of the calling thread, where the threads outside the pool share slot 0
+	size_t slot() const {
+		return current().pool == this ? current().slot : 0;
+	}
+	struct identity {
+		const task_pool* pool;
+		size_t slot;
+	};
+	static identity& current() {
+		static thread_local identity id = { nullptr, 0 };
+		return id;
+	}
+
+	struct queue {
+		std::mutex lock;
+		std::deque<task> tasks;
+		char padding[64]; // not to share a cache line with the next queue
+	};
+	std::vector<queue> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> queued; // the number of tasks in all the queues
+	std::mutex idle;
+	std::condition_variable wakeup;
+	bool stop;
+};
@@ -0,0 +1,104 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * queue.h: Bounded lock-free queue for passing episodes between threads
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <utility>
+
+/**
+ * a bounded multi-producer multi-consumer queue
+ *
+ * each cell carries a sequence number, which tells whether the cell is ready for the producer
+ * of a position (sequence == position) or for the consumer of a position (sequence == position + 1),
+ * so that producers and consumers only contend on their own counters
+ *
+ * the capacity is rounded up to a power of two
+ */
+template<typename type>
+class bounded_queue {
+public:
+	bounded_queue(size_t capacity) : cells(capacity_of(capacity)), mask(cells.size() - 1), head(0), tail(0) {
+		for (size_t i = 0; i < cells.size(); i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	bounded_queue(const bounded_queue&) = delete;
+	bounded_queue& operator =(const bounded_queue&) = delete;
+
+public:
+	/**
+	 * try to push an item, return false if the queue is full
+	 */
+	bool try_push(type& item) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;) {
+			cell& c = cells[pos & mask];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			if (seq == pos) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					c.item = std::move(item);
+					c.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (seq < pos) {
+				return false;
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * try to pop an item, return false if the queue is empty
+	 */
+	bool try_pop(type& item) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		for (;;) {
+			cell& c = cells[pos & mask];
+			size_t seq = c.sequence.load(std::memory_order_acquire);
+			if (seq == pos + 1) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					item = std::move(c.item);
+					c.sequence.store(pos + cells.size(), std::memory_order_release);
+					return true;
+				}
+			} else if (seq < pos + 1) {
+				return false;
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * push an item, yield until there is a free cell
+	 */
+	void push(type& item) {
+		while (!try_push(item)) std::this_thread::yield();
+	}
+
+	size_t capacity() const { return cells.size(); }
+
+private:
+	static size_t capacity_of(size_t n) {
+		size_t size = 2;
+		while (size < n) size <<= 1;
+		return size;
+	}
+
+	struct cell {
+		std::atomic<size_t> sequence;
+		type item;
+		cell() : sequence(0) {}
+	};
+	std::vector<cell> cells;
+	const size_t mask;
+	alignas(64) std::atomic<size_t> head; // the next position to pop
+	alignas(64) std::atomic<size_t> tail; // the next position to push
+};
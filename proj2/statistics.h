@@ -9,12 +9,86 @@
 
 #pragma once
 #include <deque>
+#include <memory>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
 #include "board.h"
 #include "action.h"
 #include "episode.h"
+#include "archive.h"
+
+/**
+ * a histogram of latencies in nanoseconds, with 8 buckets for each power of two,
+ * so that a percentile is reported within 12.5% of the actual value
+ */
+class histogram {
+public:
+	histogram() : bucket(), num(0), max(0) {}
+
+	void add(uint64_t ns) {
+		bucket[index(ns)]++;
+		num++;
+		max = std::max(max, ns);
+	}
+
+	size_t size() const { return num; }
+	uint64_t maximum() const { return max; }
+
+	/**
+	 * the p-th percentile, i.e., the upper bound of the bucket where p of the latencies fall
+	 */
+	uint64_t percentile(double p) const {
+		size_t rank = std::max<size_t>(size_t(p * num + 0.5), 1);
+		for (size_t i = 0, c = 0; i < buckets; i++) {
+			if ((c += bucket[i]) >= rank) return std::min(upper(i), max);
+		}
+		return max;
+	}
+
+	/**
+	 * print the percentiles, e.g., "p50 = 14.2us, p90 = 18.4us, p99 = 40.9us, max = 1.2ms"
+	 */
+	friend std::ostream& operator <<(std::ostream& out, const histogram& h) {
+		out << "p50 = " << unit(h.percentile(0.50)) << ", ";
+		out << "p90 = " << unit(h.percentile(0.90)) << ", ";
+		out << "p99 = " << unit(h.percentile(0.99)) << ", ";
+		out << "max = " << unit(h.maximum());
+		return out;
+	}
+
+private:
+	static constexpr size_t buckets = 62 * 8;
+
+	// the values below 16 have their own buckets, and the others share a bucket with the same leading 4 bits
+	static size_t index(uint64_t v) {
+		if (v < 16) return v;
+		unsigned e = 63 - __builtin_clzll(v);
+		return (e - 2) * 8 + ((v >> (e - 3)) & 7);
+	}
+	static uint64_t upper(size_t i) {
+		if (i < 16) return i;
+		unsigned e = i / 8 + 2;
+		return ((9 + i % 8) << (e - 3)) - 1;
+	}
+	static std::string unit(uint64_t ns) {
+		std::stringstream ss;
+		ss << std::fixed << std::setprecision(1);
+		if (ns < 1000) ss << ns << "ns";
+		else if (ns < 1000000) ss << (ns / 1e3) << "us";
+		else if (ns < 1000000000) ss << (ns / 1e6) << "ms";
+		else ss << (ns / 1e9) << "s";
+		return ss.str();
+	}
+
+	size_t bucket[buckets];
+	size_t num;
+	uint64_t max;
+};
 
 class statistics {
 public:
@@ -23,13 +97,16 @@ public:
 	 * the block size of statistics
 	 * the limit of saving records
 	 *
+	 * whether to keep only the summaries of episodes, i.e., without the moves
+	 *
 	 * note that total >= limit >= block
 	 */
-	statistics(size_t total, size_t block = 0, size_t limit = 0)
+	statistics(size_t total, size_t block = 0, size_t limit = 0, bool summary_only = false)
 		: total(total),
 		  block(block ? block : total),
 		  limit(limit ? limit : total),
-		  count(0) {}
+		  count(0),
+		  summary_only(summary_only) {}
 
 public:
 	/**
@@ -50,28 +127,23 @@ public:
 	 * 'ops = 1346086 (2840867|955796)': the average speed is 1346086
 	 *                                   the average speed of the slider is 2840867
 	 *                                   the average speed of the placer is 955796
+	 * and the latencies of the moves of both agents, e.g.,
+	 *         slide   p50 = 415ns, p90 = 639ns, p99 = 959ns, max = 40.1us
+	 *         place   p50 = 79ns, p90 = 119ns, p99 = 191ns, max = 14.7us
+	 * where the latencies are of the last block if it is shown, or of all the episodes otherwise
 	 * '84.1%': 84.1% of the games reached 24-tiles, i.e., win rate of 24-tile
 	 * '45.3%': 45.3% of the games terminated with 24-tiles as the largest tile
+	 *
+	 * the last block and all the kept episodes are read from the running sums, see remember,
+	 * and only the other numbers of episodes are summed again
 	 */
 	void show(bool tstat = true, size_t blk = 0) const {
-		size_t num = std::min(data.size(), blk ?: block);
-		size_t stat[64] = { 0 };
-		size_t sop = 0, pop = 0, eop = 0;
-		time_t sdu = 0, pdu = 0, edu = 0;
-		board::score sum = 0, max = 0;
-		auto it = data.end();
-		for (size_t i = 0; i < num; i++) {
-			auto& ep = *(--it);
-			sum += ep.score();
-			max = std::max(ep.score(), max);
-			stat[*std::max_element(ep.state().begin(), ep.state().end())]++;
-			sop += ep.step();
-			pop += ep.step(action::slide::type);
-			eop += ep.step(action::place::type);
-			sdu += ep.time();
-			pdu += ep.time(action::slide::type);
-			edu += ep.time(action::place::type);
-		}
+		size_t num = std::min(records.size(), blk ?: block);
+		sums agg = recent(num);
+		const size_t* stat = agg.stat;
+		size_t sop = agg.steps[0], pop = agg.steps[1], eop = agg.steps[2];
+		time_t sdu = agg.times[0], pdu = agg.times[1], edu = agg.times[2];
+		board::score sum = agg.sum, max = agg.max;
 
 		std::ios ff(nullptr);
 		ff.copyfmt(std::cout);
@@ -79,16 +151,19 @@ public:
 		std::cout << count << "\t";
 		std::cout << "avg = " << (sum / num) << ", ";
 		std::cout << "max = " << (max) << ", ";
-		std::cout << "ops = " << (sop * 1000.0 / sdu);
-		std::cout <<     " (" << (pop * 1000.0 / pdu);
-		std::cout <<      "|" << (eop * 1000.0 / edu) << ")";
+		std::cout << "ops = " << (sop * 1e9 / sdu);
+		std::cout <<     " (" << (pop * 1e9 / pdu);
+		std::cout <<      "|" << (eop * 1e9 / edu) << ")";
 		std::cout << std::endl;
+		const latency& lat = num == last.num && current.num == 0 ? latency_last : latency_all;
+		std::cout << "\t" "slide" "\t" << lat.slide << std::endl;
+		std::cout << "\t" "place" "\t" << lat.place << std::endl;
 		std::cout.copyfmt(ff);
 
 		if (!tstat) return;
 		for (size_t t = 0, c = 0; c < num; c += stat[t++]) {
 			if (stat[t] == 0) continue;
-			size_t accu = std::accumulate(std::begin(stat) + t, std::end(stat), size_t(0));
+			size_t accu = std::accumulate(stat + t, stat + 64, size_t(0));
 			std::cout << "\t" << board::itot(t); // type
 			std::cout << "\t" << (accu * 100.0 / num) << "%"; // win rate
 			std::cout << "\t" "(" << (stat[t] * 100.0 / num) << "%" ")"; // percentage of ending
@@ -98,7 +173,7 @@ public:
 	}
 
 	void summary() const {
-		show(true, data.size());
+		show(true, records.size());
 	}
 
 	bool is_finished() const {
@@ -106,16 +181,118 @@ public:
 	}
 
 	void open_episode(const std::string& flag = "") {
-		if (count++ >= limit) data.pop_front();
+		if (count++ >= limit) forget();
 		data.emplace_back();
 		data.back().open_episode(flag);
 	}
 
 	void close_episode(const std::string& flag = "") {
 		data.back().close_episode(flag);
+		if (log) log->append(data.back());
+		remember(data.back());
+		if (summary_only) data.pop_back();
 		if (count % block == 0) show();
 	}
 
+	/**
+	 * append an episode played elsewhere, e.g., by a worker thread
+	 * the statistics of every block are shown only if report is set
+	 */
+	void push_episode(episode&& ep, bool report = true) {
+		if (count++ >= limit) forget();
+		if (log) log->append(ep);
+		remember(ep);
+		if (!summary_only) data.push_back(std::move(ep));
+		if (report && count % block == 0) show();
+	}
+
+	/**
+	 * append an episode loaded from a file, which is not written to the log
+	 */
+	void load_episode(episode&& ep) {
+		count++;
+		remember(ep);
+		if (!summary_only) data.push_back(std::move(ep));
+		total = std::max(total, count);
+	}
+
+	/**
+	 * load the episodes saved in the text format, i.e., as operator >>, with the given number of threads
+	 *
+	 * the file is mapped and split into chunks at line boundaries, each of which is parsed and verified by
+	 * its own thread, see episode::verify; the episodes are then appended in order, where the invalid ones
+	 * are reported and skipped
+	 *
+	 * return the number of invalid episodes
+	 */
+	size_t load(const std::string& path, size_t threads = 1) {
+		arena file;
+		if (!file.map(path)) return 0;
+		const char* begin = file.data();
+		const char* end = begin + file.size();
+		const char* blank = begin < end && *begin == '\n' ? begin : static_cast<const char*>(memmem(begin, end - begin, "\n\n", 2));
+		if (blank) end = blank + (blank != begin); // the episodes end at the first empty line
+
+		threads = std::max<size_t>(std::min<size_t>(threads, (end - begin) / 65536 + 1), 1);
+		std::vector<const char*> bound(threads + 1, end);
+		bound[0] = begin;
+		for (size_t k = 1; k < threads; k++) {
+			const char* p = std::max(begin + (end - begin) * k / threads, bound[k - 1]);
+			const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+			bound[k] = eol ? eol + 1 : end;
+		}
+
+		struct chunk {
+			std::vector<episode> episodes;
+			std::vector<size_t> verified; // the index of the first invalid move, see episode::verify
+		};
+		std::vector<chunk> chunks(threads);
+		auto parse = [&](size_t k) {
+			for (const char* p = bound[k]; p < bound[k + 1]; ) {
+				const char* eol = static_cast<const char*>(std::memchr(p, '\n', bound[k + 1] - p));
+				if (!eol) eol = bound[k + 1];
+				chunks[k].episodes.emplace_back();
+				episode& ep = chunks[k].episodes.back();
+				std::stringstream line(std::string(p, eol));
+				line >> ep; // which replays the moves, and fails if any of them is invalid
+				chunks[k].verified.push_back(line.fail() ? ep.verify() : ep.step());
+				p = eol + 1;
+			}
+		};
+		std::vector<std::thread> workers;
+		for (size_t k = 1; k < threads; k++) workers.emplace_back(parse, k);
+		parse(0);
+		for (std::thread& worker : workers) worker.join();
+
+		size_t invalid = 0, line = 0;
+		for (chunk& c : chunks) {
+			for (size_t i = 0; i < c.episodes.size(); i++, line++) {
+				episode& ep = c.episodes[i];
+				if (c.verified[i] < ep.step()) {
+					std::cerr << path << ":" << (line + 1) << ": invalid move " << c.verified[i];
+					std::cerr << " (" << ep.actions()[c.verified[i]] << ")" << std::endl;
+					invalid++;
+					continue;
+				}
+				load_episode(std::move(ep));
+			}
+			c.episodes.clear();
+		}
+		return invalid;
+	}
+
+	/**
+	 * write the episodes to a binary log as they are recorded, starting with the kept episodes, see archive
+	 * the log is completed by close_log, or when the statistics is destroyed
+	 */
+	void open_log(const std::string& path) {
+		log.reset(new archive::writer(path));
+		for (const episode& ep : data) log->append(ep);
+	}
+	void close_log() {
+		log.reset();
+	}
+
 	episode& at(size_t i) {
 		return data.at(i);
 	}
@@ -135,18 +312,113 @@ public:
 	}
 	friend std::istream& operator >>(std::istream& in, statistics& stat) {
 		for (std::string line; std::getline(in, line) && line.size(); ) {
-			stat.data.emplace_back();
-			std::stringstream(line) >> stat.data.back();
+			episode ep;
+			std::stringstream(line) >> ep;
+			stat.load_episode(std::move(ep));
 		}
-		stat.total = std::max(stat.total, stat.data.size());
-		stat.count = stat.data.size();
 		return in;
 	}
 
+private:
+	// drop the oldest episode, whose moves are not kept if summary_only is set
+	void forget() {
+		const record& rec = records.front();
+		kept.add(rec, -1);
+		if (maxima.front() == rec.score) maxima.pop_front();
+		records.pop_front();
+		if (data.size()) data.pop_front();
+	}
+
+	/**
+	 * the summary of an episode, i.e., the score, the largest tile,
+	 * and the steps and the time of both agents, which are all that show needs
+	 */
+	struct record {
+		board::score score;
+		board::cell tile;
+		size_t steps[3]; // total, slider, placer
+		time_t times[3];
+		record(const episode& ep) : score(ep.score()), tile(*std::max_element(ep.state().begin(), ep.state().end())),
+			steps{ ep.step(), ep.step(action::slide::type), ep.step(action::place::type) },
+			times{ ep.time(), ep.time(action::slide::type), ep.time(action::place::type) } {}
+	};
+
+	/**
+	 * the sums of records, where max is only kept for the records added without removal
+	 */
+	struct sums {
+		size_t num = 0;
+		board::score sum = 0, max = 0;
+		size_t stat[64] = {};
+		size_t steps[3] = {};
+		time_t times[3] = {};
+		void add(const record& rec, int sign = 1) {
+			num += sign;
+			sum += sign * rec.score;
+			max = std::max(rec.score, max);
+			stat[rec.tile] += sign;
+			for (int i = 0; i < 3; i++) steps[i] += sign * rec.steps[i], times[i] += sign * rec.times[i];
+		}
+	};
+
+	/**
+	 * add the record of the latest episode, and update the running sums in O(1), i.e.,
+	 * the sums of the current block, which become the last block when the block is completed,
+	 * and the sums of all the kept records, whose max is the front of a decreasing deque of scores
+	 */
+	void remember(const episode& ep) {
+		records.emplace_back(ep);
+		const record& rec = records.back();
+		kept.add(rec);
+		while (maxima.size() && maxima.back() < rec.score) maxima.pop_back();
+		maxima.push_back(rec.score);
+		current.add(rec);
+		latency_current.add(ep);
+		latency_all.add(ep);
+		if (block && count % block == 0) {
+			last = current, current = {};
+			latency_last = latency_current, latency_current = {};
+		}
+	}
+
+	/**
+	 * the latencies of the moves of both agents
+	 */
+	struct latency {
+		histogram slide, place;
+		void add(const episode& ep) {
+			ep.each_time(action::slide::type, [&](time_t t) { slide.add(t); });
+			ep.each_time(action::place::type, [&](time_t t) { place.add(t); });
+		}
+	};
+
+	// the sums of the latest num records
+	sums recent(size_t num) const {
+		if (num == records.size() && num) {
+			sums agg = kept;
+			agg.max = maxima.front();
+			return agg;
+		}
+		if (num == last.num && current.num == 0) return last;
+		sums agg;
+		for (auto it = records.end() - num; it != records.end(); it++) agg.add(*it);
+		return agg;
+	}
+
 private:
 	size_t total;
 	size_t block;
 	size_t limit;
 	size_t count;
-	std::deque<episode> data;
+	bool summary_only;
+	std::deque<episode> data; // the episodes with moves, which is empty if summary_only is set
+	std::deque<record> records;
+	sums kept; // the sums of records
+	std::deque<board::score> maxima; // the decreasing maxima of records
+	sums current; // the sums of the current block
+	sums last; // the sums of the last completed block
+	latency latency_current; // the latencies of the current block
+	latency latency_last; // the latencies of the last completed block
+	latency latency_all; // the latencies of all the episodes
+	std::unique_ptr<archive::writer> log; // the binary log of the recorded episodes, if any
 };
@@ -11,20 +11,31 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <sstream>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistics.h"
+#include "archive.h"
+#include "queue.h"
 
 int main(int argc, const char* argv[]) {
 	std::cout << "Threes! Demo: ";
 	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
 	std::cout << std::endl << std::endl;
 
-	size_t total = 1000, block = 0, limit = 0;
+	size_t total = 1000, block = 0, limit = 0, threads = 1;
+	size_t actors = 0, learners = 1, batch = 16, refresh = 100;
 	std::string slide_args, place_args;
 	std::string load_path, save_path;
+	std::string schedule;
+	bool summary = false;
 	for (int i = 1; i < argc; i++) {
 		std::string arg = argv[i];
 		auto match_arg = [&](std::string flag) -> bool {
@@ -45,19 +56,40 @@ int main(int argc, const char* argv[]) {
 			slide_args = next_opt();
 		} else if (match_arg("place") || match_arg("env")) {
 			place_args = next_opt();
+		} else if (match_arg("threads")) {
+			threads = std::max<size_t>(std::stoull(next_opt()), 1);
+		} else if (match_arg("actors")) {
+			actors = std::stoull(next_opt());
+		} else if (match_arg("learners")) {
+			learners = std::max<size_t>(std::stoull(next_opt()), 1);
+		} else if (match_arg("batch")) {
+			batch = std::max<size_t>(std::stoull(next_opt()), 1);
+		} else if (match_arg("refresh")) {
+			refresh = std::max<size_t>(std::stoull(next_opt()), 1);
+		} else if (match_arg("schedule")) {
+			schedule = next_opt();
 		} else if (match_arg("load")) {
 			load_path = next_opt();
 		} else if (match_arg("save")) {
 			save_path = next_opt();
+		} else if (match_arg("summary")) {
+			summary = true;
 		}
 	}
+	if (summary && save_path.size() && !archive::match(save_path)) {
+		std::cerr << "--save needs the moves of episodes, which are not kept with --summary, except for --save=*.bin" << std::endl;
+		return -1;
+	}
 
-	statistics stats(total, block, limit);
+	statistics stats(total, block, limit, summary);
 
 	if (load_path.size()) {
-		std::ifstream in(load_path, std::ios::in);
-		in >> stats;
-		in.close();
+		if (archive::match(load_path)) {
+			archive::reader in(load_path);
+			for (size_t i = 0; i < in.size(); i++) stats.load_episode(in.at(i));
+		} else {
+			stats.load(load_path, std::thread::hardware_concurrency());
+		}
 		if (stats.is_finished()) stats.summary();
 	}
 
@@ -65,14 +97,18 @@ int main(int argc, const char* argv[]) {
 	// greedy_slider slide(slide_args);
 	td_slider slide(slide_args);
 	random_placer place(place_args);
+	if (actors && slide.learns_online()) { // the actors only export the episodes, which are learned backward
+		std::cerr << "online=1 and lambda= cannot be used with --actors" << std::endl;
+		return -1;
+	}
 
-	while (!stats.is_finished()) {
+	auto play = [&](td_slider& slide, random_placer& place) -> episode {
 		// std::cerr << "======== Game " << stats.step() << " ========" << std::endl;
 		slide.open_episode("~:" + place.name());
 		place.open_episode(slide.name() + ":~");
 
-		stats.open_episode(slide.name() + ":" + place.name());
-		episode& game = stats.back();
+		episode game;
+		game.open_episode(slide.name() + ":" + place.name());
 		while (true) {
 			agent& who = game.take_turns(slide, place);
 			action move = who.take_action(game.state());
@@ -81,19 +117,208 @@ int main(int argc, const char* argv[]) {
 			if (who.check_for_win(game.state())) break;
 		}
 		agent& win = game.last_turns(slide, place);
-		stats.close_episode(win.name());
-
-		slide.update_episode();
+		game.close_episode(win.name());
 
 		slide.close_episode(win.name());
 		place.close_episode(win.name());
-	}
+		return game;
+	};
+	// train the weights of slide until stats is finished
+	auto train = [&](statistics& stats, size_t total) {
+		std::atomic<size_t> ticket(stats.step());
+		std::mutex merge;
+		auto finish = [&](episode& game) {
+			std::lock_guard<std::mutex> lock(merge);
+			stats.push_episode(std::move(game));
+		};
+
+		if (actors == 0) {
+			/**
+			 * each worker plays its own episodes with its own placer, and the sliders of all the workers
+			 * share the weight tables of slide, see weight_agent; the episodes are claimed by tickets,
+			 * and are merged into stats as they finish
+			 */
+			auto work = [&](td_slider& slide, random_placer& place) {
+				while (ticket++ < total) {
+					episode game = play(slide, place);
+					slide.update_episode();
+					finish(game);
+				}
+			};
+			std::vector<std::thread> workers;
+			for (size_t i = 1; i < threads; i++) {
+				workers.emplace_back([&, i]() {
+					td_slider shared(slide);
+					random_placer place(place_args + " stream=" + std::to_string(i));
+					work(shared, place);
+				});
+			}
+			work(slide, place);
+			for (std::thread& worker : workers) worker.join();
+
+		} else {
+			/**
+			 * the actors play episodes with their own snapshots of the weights, which are refreshed every
+			 * 'refresh' episodes, and pass the trajectories to the learners through a bounded queue;
+			 * the learners update the weights of slide in batches of 'batch' trajectories
+			 *
+			 * the lag of a trajectory is the number of trajectories learned since its snapshot was taken,
+			 * which tells how far off-policy the learned data are
+			 */
+			bounded_queue<td_slider::trajectory> queue(std::max(actors, learners) * batch * 2);
+			std::atomic<size_t> learned(0), running(actors);
+			std::atomic<size_t> lag_sum(0), lag_max(0);
+			std::vector<std::thread> workers;
+			for (size_t i = 0; i < actors; i++) {
+				workers.emplace_back([&, i]() {
+					td_slider actor(slide);
+					random_placer place(place_args + (i ? " stream=" + std::to_string(i) : ""));
+					td_slider::trajectory path;
+					size_t version = 0;
+					for (size_t n = 0; ticket++ < total; n++) {
+						if (n % refresh == 0) {
+							version = learned.load();
+							actor.snapshot_weights(slide);
+						}
+						episode game = play(actor, place);
+						actor.export_episode(path);
+						path.version = version;
+						queue.push(path);
+						finish(game);
+					}
+					running--;
+				});
+			}
+			for (size_t i = 0; i < learners; i++) {
+				workers.emplace_back([&]() {
+					td_slider learner(slide);
+					std::vector<td_slider::trajectory> paths(batch);
+					size_t sum = 0, max = 0;
+					while (true) {
+						bool done = running.load() == 0;
+						size_t n = 0;
+						while (n < batch && queue.try_pop(paths[n])) n++;
+						if (n == 0) {
+							if (done) break;
+							std::this_thread::yield();
+							continue;
+						}
+						for (size_t k = 0; k < n; k++) {
+							size_t lag = learned++ - paths[k].version;
+							sum += lag;
+							max = std::max(max, lag);
+							learner.learn_episode(paths[k]);
+						}
+					}
+					lag_sum += sum;
+					for (size_t m = lag_max.load(); m < max && !lag_max.compare_exchange_weak(m, max); );
+				});
+			}
+			for (std::thread& worker : workers) worker.join();
+
+			std::cout << "learned " << learned << " episodes, lag = " << (learned ? lag_sum / learned : 0)
+			          << " (" << lag_max << ")" << std::endl << std::endl;
+		}
+	};
 
-	if (save_path.size()) {
-		std::ofstream out(save_path, std::ios::out | std::ios::trunc);
+	// the path to save the statistics, or the path with a phase tag, e.g., stats.eval.1.txt
+	auto stats_path = [&](const std::string& tag) -> std::string {
+		std::string path = save_path;
+		if (tag.size()) {
+			size_t ext = path.find_last_of('.');
+			ext = ext != std::string::npos && ext > path.find_last_of('/') + 1 ? ext : path.size();
+			path.insert(ext, "." + tag);
+		}
+		return path;
+	};
+	// start to save the statistics, where a binary log (e.g., stats.bin) is written as the episodes are recorded
+	auto open_stats = [&](statistics& stats, const std::string& tag) {
+		if (save_path.size() && archive::match(save_path)) stats.open_log(stats_path(tag));
+	};
+	// finish saving the statistics, where a text file (e.g., stats.txt) is written with the kept episodes
+	auto save_stats = [&](statistics& stats, const std::string& tag) {
+		if (save_path.empty()) return;
+		if (archive::match(save_path)) return stats.close_log();
+		std::ofstream out(stats_path(tag), std::ios::out | std::ios::trunc);
 		out << stats;
 		out.close();
+	};
+
+	if (schedule.empty()) {
+		open_stats(stats, "");
+		train(stats, total);
+		save_stats(stats, "");
+		return 0;
+	}
+
+	/**
+	 * the schedule of phases, e.g., "train:100000,eval:1000", which is repeated until 'total' games are trained
+	 *
+	 * the weights stay resident across the phases; each evaluation plays with a frozen snapshot of the weights
+	 * and the same placer seed in a background thread, while the next training phase continues
+	 * the statistics of each phase are saved to their own files, e.g., stats.train.1.txt and stats.eval.1.txt
+	 */
+	std::vector<std::pair<std::string, size_t>> phases;
+	for (std::stringstream ss(schedule); ss.good(); ) {
+		std::string phase;
+		std::getline(ss, phase, ',');
+		size_t colon = phase.find(':');
+		std::string name = phase.substr(0, colon), count = colon != std::string::npos ? phase.substr(colon + 1) : "";
+		if ((name != "train" && name != "eval") || count.empty() || count.size() > 18 || count.find_first_not_of("0123456789") != std::string::npos) {
+			std::cerr << "unknown phase: " << phase << std::endl;
+			return -1;
+		}
+		phases.emplace_back(name, std::stoull(count));
+	}
+	if (std::none_of(phases.begin(), phases.end(), [](const std::pair<std::string, size_t>& p) { return p.first == "train" && p.second; })) {
+		std::cerr << "no training phase: " << schedule << std::endl;
+		return -1;
+	}
+
+	std::unique_ptr<td_slider> frozen;
+	std::unique_ptr<statistics> evaluated;
+	std::thread evaluation;
+	std::string evaluated_tag;
+	auto finish_evaluation = [&]() {
+		if (!evaluation.joinable()) return;
+		evaluation.join();
+		std::cout << evaluated_tag << ":" << std::endl;
+		evaluated->summary();
+		save_stats(*evaluated, evaluated_tag);
+	};
+	for (size_t trained = 0, cycle = 1; trained < total; cycle++) {
+		for (auto& phase : phases) {
+			std::string tag = phase.first + "." + std::to_string(cycle);
+			if (phase.first == "train") {
+				size_t n = std::min(phase.second, total - trained);
+				if (n == 0) continue;
+				statistics stats(n, std::min(block ? block : n, n), std::min(limit ? limit : n, n), summary);
+				open_stats(stats, tag);
+				train(stats, n);
+				trained += n;
+				save_stats(stats, tag);
+			} else {
+				finish_evaluation();
+				if (!frozen) {
+					frozen.reset(new td_slider(slide));
+					frozen->notify("alpha=0");
+				}
+				frozen->snapshot_weights(slide);
+				evaluated.reset(new statistics(phase.second, 0, 0, summary));
+				evaluated_tag = tag;
+				open_stats(*evaluated, tag);
+				evaluation = std::thread([&]() {
+					random_placer place(place_args);
+					while (!evaluated->is_finished()) {
+						episode game = play(*frozen, place);
+						frozen->update_episode();
+						evaluated->push_episode(std::move(game), false);
+					}
+				});
+			}
+		}
 	}
+	finish_evaluation();
 
 	return 0;
 }
@@ -0,0 +1,127 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * transposition.h: Lock-free transposition table for the search
+ *
+ * Author: Theory of Computer Games
+ *         Computer Games and Intelligence (CGI) Lab, NYCU, Taiwan
+ *         https://cgilab.nctu.edu.tw/
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include "board.h"
+#include "arena.h"
+
+/**
+ * a fixed-size table of searched values, indexed by the hash of boards
+ *
+ * each entry is two words, the data and the key xor the data, which are read and written
+ * without locks; an entry torn by concurrent writes fails the key check and is simply a miss
+ *
+ * a value is kept with the depth it was searched for, and only serves the searches of the same depth,
+ * since mixing the values of different depths among siblings changes the moves selected
+ */
+class transposition {
+public:
+	/**
+	 * the kinds of cached values, i.e., the best moves estimated without searching, the expected values
+	 * of afterstates, and the best moves by searching, where the first only depend on the tiles
+	 * note that the leaves are not cached by default, since a probe costs about the same as estimating them
+	 */
+	enum kind { leaf, chance, max };
+
+	transposition(size_t bits = 0) : table(nullptr), mask(0), size_bits(0), probes(), hits() { resize(bits); }
+	transposition(const transposition&) = delete;
+	transposition& operator =(const transposition&) = delete;
+
+	// allocate 2^bits empty entries, or disable the table if bits is 0
+	void resize(size_t bits) {
+		size_bits = bits;
+		memory.allocate(bits ? sizeof(entry) << bits : 0);
+		table = reinterpret_cast<entry*>(memory.data());
+		mask = bits ? (size_t(1) << bits) - 1 : 0;
+	}
+	size_t bits() const { return size_bits; }
+	bool enabled() const { return table != nullptr; }
+
+	// forget all the values, e.g., after the weights are changed, which must not race with the searches
+	void clear() {
+		if (enabled()) std::memset(table, 0, sizeof(entry) << size_bits);
+	}
+
+public:
+	/**
+	 * the key of a board, where the leaves only depend on the tiles,
+	 * and the searched values also depend on the hint, the bag, and the last action
+	 */
+	static uint64_t key(const board& b, kind k) {
+		return mix(b.raw() ^ mix(k == leaf ? 0 : b.info() + 1));
+	}
+
+	/**
+	 * find the value of a key searched for the given depth
+	 */
+	bool find(uint64_t key, unsigned depth, float& value, kind k) const {
+		const entry& e = table[key & mask];
+		uint64_t data = __atomic_load_n(&e.data, __ATOMIC_RELAXED);
+		uint64_t check = __atomic_load_n(&e.check, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&probes[k], 1, __ATOMIC_RELAXED);
+		if ((check ^ data) != key || (data >> 32) != depth + 1) return false;
+		uint32_t bits = uint32_t(data);
+		std::memcpy(&value, &bits, sizeof(value));
+		__atomic_fetch_add(&hits[k], 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	/**
+	 * store the value of a key searched for the given depth, which always replaces the entry
+	 */
+	void store(uint64_t key, unsigned depth, float value) {
+		entry& e = table[key & mask];
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		uint64_t data = (uint64_t(depth + 1) << 32) | bits; // the depth is offset by 1, so that an empty entry is never valid
+		__atomic_store_n(&e.data, data, __ATOMIC_RELAXED);
+		__atomic_store_n(&e.check, key ^ data, __ATOMIC_RELAXED);
+	}
+
+	void prefetch(uint64_t key) const { __builtin_prefetch(table + (key & mask)); }
+
+	/**
+	 * show the hit rates, e.g.,
+	 * transposition: 2^20 entries, 1346086 probes, 41.3% hits (leaf 35.2%, chance 62.7%, max 12.5%)
+	 */
+	void show() const {
+		size_t probe = probes[leaf] + probes[chance] + probes[max], hit = hits[leaf] + hits[chance] + hits[max];
+		std::ios ff(nullptr);
+		ff.copyfmt(std::cout);
+		std::cout << std::fixed << std::setprecision(1);
+		std::cout << "transposition: 2^" << size_bits << " entries, " << probe << " probes, ";
+		std::cout << rate(hit, probe) << "% hits (leaf " << rate(hits[leaf], probes[leaf]) << "%, ";
+		std::cout << "chance " << rate(hits[chance], probes[chance]) << "%, ";
+		std::cout << "max " << rate(hits[max], probes[max]) << "%)" << std::endl;
+		std::cout.copyfmt(ff);
+	}
+
+private:
+	static uint64_t mix(uint64_t x) {
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+	static double rate(size_t hit, size_t probe) { return probe ? hit * 100.0 / probe : 0; }
+
+	struct entry {
+		uint64_t check; // the key xor the data
+		uint64_t data; // (depth + 1:32-bit) (value:32-bit)
+	};
+	arena memory;
+	entry* table;
+	size_t mask;
+	size_t size_bits;
+	mutable size_t probes[3];
+	mutable size_t hits[3];
+};
@@ -15,6 +15,108 @@
 #include <iterator>
 #include <sstream>
 #include <cassert>
+#include <type_traits>
+#include <cstring>
+#include <cmath>
+#include <map>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+/**
+ * the feature extraction of a pattern, i.e., the indices of its isomorphisms on a board
+ */
+class pattern {
+public:
+	static const size_t iso_level = 8;
+	virtual ~pattern() {}
+
+	// the compiled patterns indexed by their cells, see tuple
+	static std::map<std::vector<uint64_t>, const pattern*>& entries() { static std::map<std::vector<uint64_t>, const pattern*> m; return m; }
+
+	// the indices of all isomorphisms on a board
+	virtual void indexof(const board& b, size_t (&index)[iso_level]) const = 0;
+	// the indices of all isomorphisms on four boards, where index[i][j] is of the isomorphism i on the board j
+	virtual void indexof(const board (&b)[4], size_t (&index)[iso_level][4]) const = 0;
+};
+
+/**
+ * the pattern with compile-time cell positions
+ * the cells of its isomorphisms are generated by constexpr, so that
+ * the indexing is fully unrolled into shifts, masks and ORs
+ *
+ * usage:
+ *   weight(tuple<0, 1, 2, 3>())
+ *   weight(tuple<0, 1, 2, 3, 4, 5>())
+ */
+template<unsigned... p> class tuple : public pattern {
+public:
+	/**
+	 * the instance registered in entries, which is the only one used for indexing,
+	 * since other instances, e.g., the temporaries in the usage above, are only tags
+	 */
+	static const tuple& instance() {
+		static const tuple t;
+		static const bool registered = (entries()[{ p... }] = &t, true);
+		(void) registered;
+		return t;
+	}
+	tuple() {}
+
+	// the cell of the isomorphism i corresponding to the cell c of the pattern,
+	// i.e., reflect horizontally if i >= 4, then rotate clockwise (i % 4) times
+	static constexpr unsigned isomorphic(unsigned i, unsigned c) { return i >= 4 ? reflect(rotate(c, i % 4)) : rotate(c, i % 4); }
+	static constexpr unsigned rotate(unsigned c, unsigned n) { return n ? rotate((3 - c % 4) * 4 + c / 4, n - 1) : c; }
+	static constexpr unsigned reflect(unsigned c) { return c - c % 4 + (3 - c % 4); }
+
+public:
+	void indexof(const board& b, size_t (&index)[iso_level]) const {
+		unroll(b.raw(), index, 1, iso<0>());
+	}
+	void indexof(const board (&b)[4], size_t (&index)[iso_level][4]) const {
+#if defined(__AVX2__)
+		unroll(_mm256_setr_epi64x(b[0].raw(), b[1].raw(), b[2].raw(), b[3].raw()), index[0], 4, iso<0>());
+#elif defined(__SSE4_1__)
+		unroll(_mm_set_epi64x(b[1].raw(), b[0].raw()), index[0] + 0, 4, iso<0>());
+		unroll(_mm_set_epi64x(b[3].raw(), b[2].raw()), index[0] + 2, 4, iso<0>());
+#else
+		for (size_t j = 0; j < 4; ++j) unroll(b[j].raw(), index[0] + j, 4, iso<0>());
+#endif
+	}
+
+private:
+	template<unsigned i> struct iso : std::integral_constant<unsigned, i> {};
+
+	template<typename lane>
+	static void unroll(lane raw, size_t* index, size_t stride, iso<iso_level>) {}
+	template<typename lane, unsigned i>
+	static void unroll(lane raw, size_t* index, size_t stride, iso<i>) {
+		store(index + i * stride, fold<i, 0, p...>(raw));
+		unroll(raw, index, stride, iso<i + 1>());
+	}
+
+	template<unsigned i, unsigned k, unsigned c, typename lane>
+	static lane fold(lane raw) { return extract<isomorphic(i, c) * 4, k * 4>(raw); }
+	template<unsigned i, unsigned k, unsigned c, unsigned d, unsigned... r, typename lane>
+	static lane fold(lane raw) { return merge(extract<isomorphic(i, c) * 4, k * 4>(raw), fold<i, k + 1, d, r...>(raw)); }
+
+	// move the 4-bit cell at bit 'from' of each 64-bit lane to bit 'to'
+	template<unsigned from, unsigned to>
+	static uint64_t extract(uint64_t raw) { return ((raw >> from) & 0x0f) << to; }
+	static uint64_t merge(uint64_t a, uint64_t b) { return a | b; }
+	static void store(size_t* index, uint64_t v) { *index = v; }
+#if defined(__AVX2__)
+	template<unsigned from, unsigned to>
+	static __m256i extract(__m256i raw) { return _mm256_slli_epi64(_mm256_and_si256(_mm256_srli_epi64(raw, from), _mm256_set1_epi64x(0x0f)), to); }
+	static __m256i merge(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+	static void store(size_t* index, __m256i v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(index), v); }
+#elif defined(__SSE4_1__)
+	template<unsigned from, unsigned to>
+	static __m128i extract(__m128i raw) { return _mm_slli_epi64(_mm_and_si128(_mm_srli_epi64(raw, from), _mm_set1_epi64x(0x0f)), to); }
+	static __m128i merge(__m128i a, __m128i b) { return _mm_or_si128(a, b); }
+	static void store(size_t* index, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(index), v); }
+#endif
+};
 
 
 /**
@@ -23,6 +125,10 @@
  * usage:
  *   weight({ 0, 1, 2, 3 })
  *   weight({ 0, 1, 2, 3, 4, 5 })
+ *   weight({ 0, 1, 2, 3, 4, 5 }, 4) // rotation only
+ *   weight(tuple<0, 1, 2, 3, 4, 5>()) // unrolled indexing, see tuple
+ *
+ * a runtime pattern uses the unrolled indexing if its tuple has been instantiated
  *
  * isomorphic level of the pattern:
  *   1: no isomorphism
@@ -38,11 +144,12 @@ public:
 	typedef std::array<cell, 4> row;
 	typedef std::array<row, 4> grid;
 	typedef uint64_t data;
+	static const size_t iso_level_ = pattern::iso_level;
 
 public:
   weight() = default;
   // there's 2^4 different kind of numbers in every tile, including, 0,1,2,3,6,12,24,48,96,...
-  weight(const std::vector<score> &p) : value(1 << (p.size() << 2)) { 
+  weight(const std::vector<score> &p, size_t iso = iso_level_) : length(size_t(1) << (p.size() << 2)), iso(iso) { 
   // weight(const std::vector<score> &p) : value(p.size()) {  
     size_t psize = p.size();
 		assert(psize != 0);
@@ -98,45 +205,216 @@ public:
     //   std::cout << std::endl;
     // }
     // std::cout << "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~leave~~~~~~~~~~~~~~~~~~~~~~~~~" << std::endl;
+    auto it = pattern::entries().find(p);
+    if (it != pattern::entries().end()) unrolled = it->second;
   }
-	weight(size_t len) : value(len) {}
-	weight(weight&& f) : value(std::move(f.value)) {}
+	template<unsigned... p>
+	weight(const tuple<p...>&, size_t iso = iso_level_) : weight(std::vector<score>({ p... }), iso) { unrolled = &tuple<p...>::instance(); }
+	weight(size_t len) : length(len) {}
+	weight(weight&& f) = default;
 	weight(const weight& f) = default;
 
 	weight& operator =(const weight& f) = default;
 	type& operator[] (size_t i) { return value[i]; }
 	const type& operator[] (size_t i) const { return value[i]; }
-	size_t size() const { return value.size(); }
+	size_t size() const { return length; }
+
+	/**
+	 * the precision of the values used by estimate
+	 * the quantized values are for inference only, since update always works on the float table
+	 *   fp32: the float table
+	 *   int16: 16-bit integers with a per-table scale
+	 *   fp16: IEEE half-precision floats
+	 */
+	enum precision { fp32, int16, fp16 };
+
+	// bind the table to the given memory of size() values, which is usually owned by an arena
+	void bind(type* mem) { value = mem; }
+	type* table() { return value; }
+	const type* table() const { return value; }
+
+	/**
+	 * bind the accumulators of Temporal Coherence to the given memory of 2 * size() values,
+	 * where each weight has its accumulated error and accumulated absolute error side by side
+	 * the step size of a weight is then scaled by |error| / |absolute error|, see update
+	 */
+	void bind_coherence(type* mem) { coherence = mem; }
+	type* coherence_table() { return coherence; }
+	const type* coherence_table() const { return coherence; }
+
+	/**
+	 * quantize the float table into the given memory of (size() + 1) 16-bit values,
+	 * and use them for estimate since then
+	 * return the maximum absolute error of the quantized values
+	 */
+	float quantize(uint16_t* mem, precision p) {
+		mode = p;
+		packed = mem;
+		float max = 0, err = 0;
+		for (size_t i = 0; i < length; ++i) max = std::max(max, std::abs(value[i]));
+		scale = max > 0 ? max / 32767 : 1;
+		for (size_t i = 0; i < length; ++i) {
+			mem[i] = mode == int16 ? uint16_t(int16_t(std::lround(value[i] / scale))) : to_half(value[i]);
+			err = std::max(err, std::abs(value[i] - packed_value(i)));
+		}
+		mem[length] = 0; // the padding for 32-bit gathers
+		return err;
+	}
+	precision quantized() const { return mode; }
+
+	// the quantized value at the given index
+	float packed_value(size_t i) const {
+		return mode == int16 ? int16_t(packed[i]) * scale : from_half(packed[i]);
+	}
+
+	static uint16_t to_half(float f) {
+#if defined(__F16C__)
+		return _cvtss_sh(f, 0);
+#else
+		uint32_t x;
+		std::memcpy(&x, &f, sizeof(x));
+		uint32_t sign = (x >> 16) & 0x8000, man = x & 0x7fffff;
+		int exp = int((x >> 23) & 0xff) - 127 + 15;
+		if (exp >= 31) return sign | 0x7c00;
+		unsigned shift = 13;
+		if (exp <= 0) { // subnormal, or too small
+			if (exp < -10) return sign;
+			man |= 0x800000;
+			shift = 14 - exp;
+			exp = 0;
+		}
+		uint32_t h = sign | (exp << 10) | (man >> shift), rem = man & ((1u << shift) - 1), half = 1u << (shift - 1);
+		return h + (rem > half || (rem == half && (h & 1))); // round to nearest even
+#endif
+	}
+	static float from_half(uint16_t h) {
+#if defined(__F16C__)
+		return _cvtsh_ss(h);
+#else
+		uint32_t sign = uint32_t(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, man = h & 0x3ff;
+		if (exp == 0) return sign ? -std::ldexp(float(man), -24) : std::ldexp(float(man), -24);
+		uint32_t x = sign | (exp == 31 ? 0x7f800000 : ((exp + 112) << 23)) | (man << 13);
+		float f;
+		std::memcpy(&f, &x, sizeof(f));
+		return f;
+#endif
+	}
 
 public:
 	// estimate the value of a given board
   float estimate(const board &b) const {
-    float value_sum = 0;
+    size_t index[iso_level_];
+    indexof(b, index);
+    return estimate(index);
+  }
 
-    // std::cout <<  "(" << isomorphism.size() << ")" <<std::endl;
-    // for(int i=0; i<isomorphism.size();i++){
-    //   std::cout << "(" << isomorphism[i].size() << ")";
-    //   for(int j=0;j<isomorphism[i].size(); j++){
-    //     std::cout << isomorphism[i][j] << " ";
-    //   }
-    //   std::cout << std::endl;
-    // }
+	// estimate the values of four boards at once, and accumulate them to the given values
+	void estimate(const board (&b)[4], float (&v)[4]) const {
+		size_t index[iso_level_][4];
+		indexof(b, index);
+		estimate(index, v);
+	}
 
-    for (size_t i = 0; i < iso_level_; ++i) {
-      size_t index = indexof(isomorphism[i], b);
-      value_sum += value[index];
+  // update the value of a given board, and return its updated value
+  float update(const board &b, float u) {
+    size_t index[iso_level_];
+    indexof(b, index);
+    return update(index, u);
+  }
+
+	/**
+	 * the lookups are split into two phases: compute the indices and prefetch their entries first,
+	 * then accumulate or update the entries, so that the cache misses of all the lookups overlap
+	 */
+	void prefetch(const size_t (&index)[iso_level_]) const {
+		for (size_t i = 0; i < iso; ++i) prefetch(index[i]);
+	}
+	void prefetch(const size_t (&index)[iso_level_][4]) const {
+		for (size_t i = 0; i < iso; ++i) {
+			for (size_t j = 0; j < 4; ++j) prefetch(index[i][j]);
+		}
+	}
+	void prefetch(size_t i) const {
+		if (mode == fp32) __builtin_prefetch(value + i);
+		else __builtin_prefetch(packed + i);
+	}
+
+	// estimate the value of a board from the indices of its isomorphisms
+  float estimate(const size_t (&index)[iso_level_]) const {
+    float value_sum = 0;
+    if (mode != fp32) {
+      for (size_t i = 0; i < iso; ++i) value_sum += packed_value(index[i]);
+      return value_sum;
+    }
+    for (size_t i = 0; i < iso; ++i) {
+      value_sum += value[index[i]];
     }
     return value_sum;
   }
 
-  // update the value of a given board, and return its updated value
-  float update(const board &b, float u) {
-    float u_split = u / iso_level_;
+	// estimate the values of four boards from the indices of their isomorphisms, and accumulate them to the given values
+	void estimate(const size_t (&index)[iso_level_][4], float (&v)[4]) const {
+		if (mode == int16) { // widen to 32-bit integers, then scale the sums
+#if defined(__AVX2__)
+			__m128i sum = _mm_setzero_si128();
+			for (size_t i = 0; i < iso; ++i) {
+				__m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index[i]));
+				__m128i raw = _mm256_i64gather_epi32(reinterpret_cast<const int*>(packed), idx, sizeof(uint16_t));
+				sum = _mm_add_epi32(sum, _mm_srai_epi32(_mm_slli_epi32(raw, 16), 16));
+			}
+			__m128 val = _mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(scale));
+			_mm_storeu_ps(v, _mm_add_ps(_mm_loadu_ps(v), val));
+#else
+			int32_t sum[4] = { 0 };
+			for (size_t i = 0; i < iso; ++i) {
+				for (size_t j = 0; j < 4; ++j) sum[j] += int16_t(packed[index[i][j]]);
+			}
+			for (size_t j = 0; j < 4; ++j) v[j] += sum[j] * scale;
+#endif
+			return;
+		} else if (mode == fp16) {
+			float sum[4] = { 0 };
+			for (size_t i = 0; i < iso; ++i) {
+				for (size_t j = 0; j < 4; ++j) sum[j] += from_half(packed[index[i][j]]);
+			}
+			for (size_t j = 0; j < 4; ++j) v[j] += sum[j];
+			return;
+		}
+#if defined(__AVX2__)
+		__m128 sum = _mm_setzero_ps();
+		for (size_t i = 0; i < iso; ++i) {
+			__m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index[i]));
+			sum = _mm_add_ps(sum, _mm256_i64gather_ps(value, idx, sizeof(type)));
+		}
+		_mm_storeu_ps(v, _mm_add_ps(_mm_loadu_ps(v), sum));
+#else
+		float sum[4] = { 0 };
+		for (size_t i = 0; i < iso; ++i) {
+			for (size_t j = 0; j < 4; ++j) sum[j] += value[index[i][j]];
+		}
+		for (size_t j = 0; j < 4; ++j) v[j] += sum[j];
+#endif
+	}
+
+  // update the value of a board from the indices of its isomorphisms, and return its updated value
+	// note that parallel workers update the shared tables without locks (Hogwild!), the rare lost updates are tolerated
+  float update(const size_t (&index)[iso_level_], float u) {
+    float u_split = u / iso;
     float value_sum = 0;
-    for (size_t i = 0; i < iso_level_; ++i) {
-      size_t index = indexof(isomorphism[i], b);
-      value[index] += u_split;
-      value_sum += value[index];
+    if (coherence) {
+      for (size_t i = 0; i < iso; ++i) __builtin_prefetch(coherence + (index[i] << 1));
+      for (size_t i = 0; i < iso; ++i) {
+        type* acc = coherence + (index[i] << 1);
+        value[index[i]] += acc[1] != 0 ? u_split * std::fabs(acc[0]) / acc[1] : u_split;
+        acc[0] += u_split;
+        acc[1] += std::fabs(u_split);
+        value_sum += value[index[i]];
+      }
+      return value_sum;
+    }
+    for (size_t i = 0; i < iso; ++i) {
+      value[index[i]] += u_split;
+      value_sum += value[index[i]];
     }
     // std::cout << "value.size: " << value.size() << std::endl;
     // for (int i=0;i<value.size();i++){
@@ -147,7 +425,52 @@ public:
     return value_sum;
   }
 
-	
+	// the indices of all isomorphisms on a board
+	void indexof(const board& b, size_t (&index)[iso_level_]) const {
+		if (unrolled) return unrolled->indexof(b, index);
+		for (size_t i = 0; i < iso; ++i) index[i] = indexof(isomorphism[i], b);
+	}
+
+	// the indices of all isomorphisms on four boards, see pattern::indexof
+	void indexof(const board (&b)[4], size_t (&index)[iso_level_][4]) const {
+		if (unrolled) return unrolled->indexof(b, index);
+#if defined(__AVX2__)
+		// each 64-bit lane holds one board, so the four boards are indexed together
+		const __m256i mask = _mm256_set1_epi64x(0x0f);
+		__m256i raw = _mm256_setr_epi64x(b[0].raw(), b[1].raw(), b[2].raw(), b[3].raw());
+		for (size_t i = 0; i < iso; ++i) {
+			const std::vector<score>& p = isomorphism[i];
+			__m256i idx = _mm256_setzero_si256();
+			for (size_t k = 0; k < p.size(); ++k) {
+				__m256i t = _mm256_and_si256(_mm256_srl_epi64(raw, _mm_cvtsi64_si128(p[k] << 2)), mask);
+				idx = _mm256_or_si256(idx, _mm256_sll_epi64(t, _mm_cvtsi64_si128(k << 2)));
+			}
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(index[i]), idx);
+		}
+#elif defined(__SSE4_1__)
+		// each 64-bit lane holds one board, two boards per register
+		const __m128i mask = _mm_set1_epi64x(0x0f);
+		__m128i raw[] = { _mm_set_epi64x(b[1].raw(), b[0].raw()), _mm_set_epi64x(b[3].raw(), b[2].raw()) };
+		for (size_t i = 0; i < iso; ++i) {
+			const std::vector<score>& p = isomorphism[i];
+			__m128i idx[] = { _mm_setzero_si128(), _mm_setzero_si128() };
+			for (size_t k = 0; k < p.size(); ++k) {
+				__m128i src = _mm_cvtsi64_si128(p[k] << 2), dst = _mm_cvtsi64_si128(k << 2);
+				for (size_t j = 0; j < 2; ++j) {
+					__m128i t = _mm_and_si128(_mm_srl_epi64(raw[j], src), mask);
+					idx[j] = _mm_or_si128(idx[j], _mm_sll_epi64(t, dst));
+				}
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(index[i] + 0), idx[0]);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(index[i] + 2), idx[1]);
+		}
+#else
+		for (size_t i = 0; i < iso; ++i) {
+			for (size_t j = 0; j < 4; ++j) index[i][j] = indexof(isomorphism[i], b[j]);
+		}
+#endif
+	}
+
 	size_t indexof(const std::vector<score> &p, const board &b) const {
     size_t index = 0;
     // std::cout << b;
@@ -176,10 +499,9 @@ public:
     out.write(reinterpret_cast<char *>(&len), sizeof(len));
     out.write(name.c_str(), len);
 		// weight
-		auto& value = w.value;
-		uint64_t size = value.size();
+		uint64_t size = w.size();
 		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-		out.write(reinterpret_cast<const char*>(value.data()), sizeof(type) * size);
+		out.write(reinterpret_cast<const char*>(w.table()), sizeof(type) * size);
 		return out;
 	}
 	friend std::istream& operator >>(std::istream& in, weight& w) {
@@ -188,20 +510,24 @@ public:
     in.read(reinterpret_cast<char *>(&len), sizeof(len));
     name.resize(len);
     in.read(&name[0], len);
-    std::cout << name << " " << w.name() << "\n";
-		assert(name == w.name());
+		if (name != w.name()) return in.setstate(std::ios::failbit), in;
 		// weight
-		auto& value = w.value;
 		uint64_t size = 0;
 		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-		value.resize(size);
-		in.read(reinterpret_cast<char*>(value.data()), sizeof(type) * size);
+		if (size != w.size() || !w.table()) return in.setstate(std::ios::failbit), in;
+		in.read(reinterpret_cast<char*>(w.table()), sizeof(type) * size);
 		return in;
 	}
 
 // protected:
 public:
-	std::vector<type> value;
-	static const size_t iso_level_ = 8;
+	type* value = nullptr; // the table, see bind
+	size_t length = 0;
 	std::array<std::vector<score>, iso_level_> isomorphism;
+	size_t iso = iso_level_; // the isomorphic level in use, i.e., 1, 4, or 8
+	const pattern* unrolled = nullptr;
+	type* coherence = nullptr; // the accumulators of Temporal Coherence, see bind_coherence
+	precision mode = fp32;
+	const uint16_t* packed = nullptr; // the quantized table, see quantize
+	float scale = 1;
 };